@@ -1,16 +1,36 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <stdbool.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "math.h"
 
 static char helpStr[] =
@@ -29,12 +49,36 @@ static char helpStr[] =
     "                --seed <d>, -s <d>: Random colors based on given seed,\n"
     "                                    implies --random\n"
     "        --color_offset <d>, -o <d>: Start with a different color\n"
-    "            --gradient <g>, -g <g>: Use color gradient from given start to end color,\n"
-    "                                    format: -g ff4444:00ffff\n"
+    "            --gradient <g>, -g <g>: Use color gradient through the given colors,\n"
+    "                                    format: -g ff4444:00ffff[:...] (up to 16\n"
+    "                                    stops) or a palette name: sunset, ocean,\n"
+    "                                    fire, forest, pastel, rainbow\n"
+    "      --interpolate <linear|oklab>: Blend gradient stops in RGB (default) or in\n"
+    "                                    the perceptual OKLab space\n"
     "                       --24bit, -b: Output in 24-bit \"true\" RGB mode (slower and\n"
     "                                    not supported by all terminals)\n"
     "                     --16color, -x: Output in 16-color mode for basic terminals\n"
     "                      --invert, -i: Invert foreground and background\n"
+    "                 --lines <from-to>: Print only lines from..to (1-based, \"to\" may\n"
+    "                                    be omitted), colored as in a full run\n"
+    "                      --line-index: Keep a FILE.lolidx line-offset index next to\n"
+    "                                    each file to seek --lines in O(range)\n"
+    "                        --adaptive: Lower color quality while stdout can't keep up\n"
+    "                                    and restore it when the consumer catches up\n"
+    "                        --jobs <n>: Colorize files on n threads (0 - one per CPU),\n"
+    "                                    output keeps the order of FILEs\n"
+    "     --file-phase <continue|reset>: With --jobs, continue the rainbow across\n"
+    "                                    files as usual or restart it in each file\n"
+    "                     --cache[=DIR]: Reuse colored output of identical input and\n"
+    "                                    options (default DIR: ~/.cache/lolcat)\n"
+    "                --cache-size <MiB>: Cache size limit, oldest used entries are\n"
+    "                                    evicted first (default: 64)\n"
+    "                       --phase <d>: Start the rainbow at phase d from 0 to 1\n"
+    "                                    instead of the one taken from the clock\n"
+    "                           --strip: Remove all escape sequences instead of coloring\n"
+    "                       --normalize: Remove only color (SGR) sequences and keep\n"
+    "                                    the other escape sequences\n"
+    "            --compress <zstd|gzip>: Compress the output in a separate thread\n"
     "                            --help: Show this message\n";
 
 
@@ -71,6 +115,16 @@ enum errorCodes {
     ERROR = -1,
 };
 
+// STRIP_OFF: Вход раскрашивается.
+// STRIP_ALL: Опция --strip, из входа удаляются все управляющие последовательности.
+// STRIP_SGR: Опция --normalize, из входа удаляются только последовательности цвета (SGR).
+enum stripMode { STRIP_OFF = 0, STRIP_ALL, STRIP_SGR };
+
+// COMPRESS_OFF: Вывод не сжимается.
+// COMPRESS_GZIP: Опция --compress gzip.
+// COMPRESS_ZSTD: Опция --compress zstd.
+enum compression { COMPRESS_OFF = 0, COMPRESS_GZIP, COMPRESS_ZSTD };
+
 // NONE: Исходное состояние, когда нет никаких управляющих последовательностей escape.
 // ESC_BEGIN: Состояние, когда встречен символ начала управляющей последовательности escape.
 // ESC_STRING: Состояние, когда обрабатывается строка управляющей последовательности.
@@ -94,6 +148,18 @@ enum escState { NONE = 0, ESC_BEGIN, ESC_STRING, ESC_CSI, ESC_STRING_TERM, ESC_C
  * x: Флаг для опции -x (--16color), указывающий, следует ли выводить результат в 16-цветном режиме для основных терминалов.
  * i: Флаг для опции -i (--invert), указывающий, следует ли инвертировать передний план и задний план.
  * help: Флаг для опции --help, указывающий, следует ли выводить сообщение о помощи.
+ * linesFrom, linesTo: Границы опции --lines в виде значений stringCount: выводятся строки,
+ *                     для которых linesFrom <= stringCount < linesTo (linesTo == 0 - опция не задана).
+ * lineIndex: Флаг для опции --line-index, указывающий, следует ли вести индекс строк FILE.lolidx.
+ * adaptive: Флаг для опции --adaptive, указывающий, следует ли снижать качество цвета при медленном выводе.
+ * jobs: Параметр для опции --jobs, задающий количество потоков раскраски (0 - опция не задана).
+ * filePhaseReset: Флаг для опции --file-phase reset, указывающий, что радуга начинается заново в каждом файле.
+ * cache: Флаг для опции --cache, указывающий, следует ли брать вывод из кеша.
+ * cacheDir: Параметр для опции --cache=DIR, задающий папку кеша (NULL - папка по умолчанию).
+ * cacheSize: Параметр для опции --cache-size, задающий предельный размер кеша в мегабайтах.
+ * phase: Параметр для опции --phase, задающий отклонение по горизонтали вместо взятого из часов (-1 - не задан).
+ * strip: Режим опций --strip и --normalize (enum stripMode).
+ * compress: Формат опции --compress (enum compression).
  */
 typedef struct {
     int f;
@@ -104,8 +170,98 @@ typedef struct {
     int x;
     int i;
     int help;
+    int linesFrom;
+    int linesTo;
+    int lineIndex;
+    int adaptive;
+    int jobs;
+    int filePhaseReset;
+    int cache;
+    char *cacheDir;
+    int cacheSize;
+    double phase;
+    int strip;
+    int compress;
 } Flags;
 
+#define GRADIENT_MAX_STOPS 16 // Максимальное количество цветов в --gradient
+#define GRADIENT_TABLE_SIZE 1024 // Количество оттенков в таблице 24-битного градиента
+#define GRADIENT_ESCAPE_SIZE 24 // Место под одну готовую управляющую последовательность в таблице
+
+/**
+ * Градиент из опции --gradient.
+ *
+ * stops: Опорные цвета, расположенные на равных расстояниях друг от друга.
+ * count: Количество опорных цветов.
+ * oklab: Флаг для опции --interpolate oklab, указывающий, что цвета смешиваются в пространстве OKLab.
+ */
+typedef struct {
+    union rgb_c stops[GRADIENT_MAX_STOPS];
+    int count;
+    int oklab;
+} Gradient;
+
+/**
+ * Именованные градиенты для --gradient.
+ */
+static const struct {
+    const char *name;
+    const char *stops;
+} gradientPalettes[] = {
+    {"sunset", "ff5e62:ff9966:ffd86f"},
+    {"ocean", "1a2a6c:0072ff:00c6ff"},
+    {"fire", "ff0000:ff7f00:ffff00"},
+    {"forest", "134e5e:71b280:c9e265"},
+    {"pastel", "ffb3ba:ffdfba:ffffba:baffc9:bae1ff"},
+    {"rainbow", "ff0000:ffff00:00ff00:00ffff:0000ff:ff00ff"},
+};
+
+/**
+ * @brief Разбирает значение опции --gradient: имя из gradientPalettes или цвета rrggbb через двоеточие.
+ *
+ * @param str Значение опции.
+ * @param gradient Указатель на градиент, в который записываются опорные цвета.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - неверный формат).
+ */
+int parseGradient(const char *str, Gradient *gradient) {
+    for (size_t i = 0; i < ARRAY_SIZE(gradientPalettes); ++i) {
+        if (!strcmp(str, gradientPalettes[i].name)) {
+            str = gradientPalettes[i].stops;
+            break;
+        }
+    }
+
+    gradient->count = 0;
+
+    for (;;) {
+        char hex[7];
+        char *endPtr;
+
+        if (gradient->count == GRADIENT_MAX_STOPS || strspn(str, "0123456789abcdefABCDEF") != 6 ||
+            (str[6] != ':' && str[6] != '\0')) {
+            return ERROR;
+        }
+
+        memcpy(hex, str, 6);
+        hex[6] = '\0';
+
+        unsigned long value = strtoul(hex, &endPtr, 16);
+        union rgb_c *stop = &gradient->stops[gradient->count++];
+
+        stop->r = value >> 16;
+        stop->g = value >> 8;
+        stop->b = value;
+
+        if (str[6] == '\0') {
+            break;
+        }
+
+        str += 7;
+    }
+
+    return gradient->count >= 2 ? OK : ERROR;
+}
+
 /**
  * @brief Функция определяет текущее состояние обработки управляющих последовательностей escape (ESC) на основе входного символа и предыдущего состояния.
  *
@@ -172,13 +328,12 @@ enum escState findEscapeSequences(char ch, enum escState state) {
  * @param freq_h Указатель на переменную, содержащую горизонтальную частоту радужных цветов.
  * @param freq_v Указатель на переменную, содержащую вертикальную частоту радужных цветов.
  * @param startColor Указатель на переменную, содержащую начальный цвет для градиента.
- * @param rgb_start Указатель на структуру rgb_c, содержащую начальный цвет для градиента в формате RGB.
- * @param rgb_end Указатель на структуру rgb_c, содержащую конечный цвет для градиента в формате RGB.
+ * @param gradient Указатель на структуру Gradient, содержащую цвета градиента.
  * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
  */
 
 int initStruct(Flags *flags, int symbol, int *seed, double *freq_h, double *freq_v, int *startColor,
-               union rgb_c *rgb_start, union rgb_c *rgb_end) {
+               Gradient *gradient) {
     int errCode = OK;
     char *endPtr;
 
@@ -222,25 +377,67 @@ int initStruct(Flags *flags, int symbol, int *seed, double *freq_h, double *freq
             break;
         case 'g':
             flags->g = true;
-            if (strlen(optarg) != 6 + 1 + 6 || optarg[6] != ':') {
+
+            if (parseGradient(optarg, gradient) != OK) {
                 wprintf(L"Invalid format for --gradient\n");
                 exit(ERROR);
             }
+            break;
+        case '8':
+            flags->cache = true;
+            flags->cacheDir = optarg;
+            break;
+        case '9':
+            flags->cacheSize = strtoul(optarg, &endPtr, 10);
 
-            char *endPtr;
-
-            optarg[6] = '\0';
-            rgb_start->i = strtoul(optarg, &endPtr, 16);
-
-            if (*endPtr) {
-                wprintf(L"Invalid format for --gradient\n");
+            if (*endPtr || *optarg == '-' || flags->cacheSize <= 0) {
+                wprintf(L"Invalid format for --cache-size\n");
                 exit(ERROR);
             }
+            break;
+        case '0':
+            flags->phase = strtod(optarg, &endPtr);
 
-            rgb_end->i = strtoul(optarg + 6 + 1, &endPtr, 16);
-
-            if (*endPtr) {
-                wprintf(L"Invalid format for --gradient\n");
+            if (*endPtr || !(flags->phase >= 0 && flags->phase < 1)) {
+                wprintf(L"Invalid format for --phase\n");
+                exit(ERROR);
+            }
+            break;
+        case 'S':
+            flags->strip = STRIP_ALL;
+            break;
+        case 'N':
+            flags->strip = STRIP_SGR;
+            break;
+        case 'Z':
+            if (!strcmp(optarg, "gzip")) {
+                flags->compress = COMPRESS_GZIP;
+            } else if (!strcmp(optarg, "zstd")) {
+                flags->compress = COMPRESS_ZSTD;
+            } else {
+                wprintf(L"Invalid format for --compress\n");
+                exit(ERROR);
+            }
+#ifndef HAVE_ZLIB
+            if (flags->compress == COMPRESS_GZIP) {
+                wprintf(L"lolcat was built without gzip support (zlib)\n");
+                exit(ERROR);
+            }
+#endif
+#ifndef HAVE_ZSTD
+            if (flags->compress == COMPRESS_ZSTD) {
+                wprintf(L"lolcat was built without zstd support (libzstd)\n");
+                exit(ERROR);
+            }
+#endif
+            break;
+        case '7':
+            if (!strcmp(optarg, "oklab")) {
+                gradient->oklab = true;
+            } else if (!strcmp(optarg, "linear")) {
+                gradient->oklab = false;
+            } else {
+                wprintf(L"Invalid format for --interpolate\n");
                 exit(ERROR);
             }
             break;
@@ -256,6 +453,59 @@ int initStruct(Flags *flags, int symbol, int *seed, double *freq_h, double *freq
         case '1':
             flags->help = true;
             break;
+        case '2': {
+            // Формат --lines: START-END или START- (до конца ввода)
+            long from = strtol(optarg, &endPtr, 10);
+            long to = INT_MAX;
+
+            if (endPtr == optarg || *endPtr != '-' || from < 1 || from >= INT_MAX) {
+                wprintf(L"Invalid format for --lines\n");
+                exit(ERROR);
+            }
+
+            if (endPtr[1]) {
+                char *rangeEnd = endPtr + 1;
+                to = strtol(rangeEnd, &endPtr, 10);
+
+                if (*endPtr || to < from || to > INT_MAX) {
+                    wprintf(L"Invalid format for --lines\n");
+                    exit(ERROR);
+                }
+            }
+
+            flags->linesFrom = from - 1;
+            flags->linesTo = to;
+            break;
+        }
+        case '3':
+            flags->lineIndex = true;
+            break;
+        case '4':
+            flags->adaptive = true;
+            break;
+        case '5':
+            flags->jobs = strtoul(optarg, &endPtr, 10);
+
+            if (*endPtr || *optarg == '-') {
+                wprintf(L"Invalid format for --jobs\n");
+                exit(ERROR);
+            }
+
+            if (flags->jobs == 0) {
+                long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+                flags->jobs = cpuCount > 0 ? cpuCount : 1;
+            }
+            break;
+        case '6':
+            if (!strcmp(optarg, "reset")) {
+                flags->filePhaseReset = true;
+            } else if (!strcmp(optarg, "continue")) {
+                flags->filePhaseReset = false;
+            } else {
+                wprintf(L"Invalid format for --file-phase\n");
+                exit(ERROR);
+            }
+            break;
         case '?':
             errCode = ERROR;
     }
@@ -314,277 +564,2919 @@ void rgbInterpolate(union rgb_c *start, union rgb_c *end, union rgb_c *out, doub
     out->g = start->g + (end->g - start->g) * factor;
 }
 
-int wcwidth(wchar_t wc);
-
-int main(int argc, char **argv) {
-    char *defaultArgv[] = {"-"}; // Массив для хранения аргументов командной строки по умолчанию
-    double freq_h = 0.23; // Горизонтальная частота радуги по умолчанию
-    double freq_v = 0.01; // Вертикальная частота радуги по умолчанию
-    int startColor = 0; // Начальный цвет радуги
-    union rgb_c rgb_start; // Начальный цвет радуги в формате RGB
-    union rgb_c rgb_end; // Конечный цвет радуги в формате RGB
+/**
+ * @brief Вычисляет цвет радуги для режима --24bit.
+ *
+ * @param theta Угол, определяющий положение символа на радуге.
+ * @param color Указатель на структуру rgb_c, куда будет записан цвет.
+ */
+void rainbowColor(float theta, union rgb_c *color) {
+    float offset = 0.1;
+    color->r = lrintf((offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta))) * 255.0f);
+    color->g = lrintf((offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta + 2 * PI / 3))) * 255.0f);
+    color->b = lrintf((offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta + 4 * PI / 3))) * 255.0f);
+}
 
-    int stringCount = 0;
-    int colorIndex = -1;
+/**
+ * @brief Вычисляет угол режима --24bit для символа.
+ *
+ * @param column Значение charCountInStr.
+ * @param line Значение stringCount.
+ * @param freq_h, freq_v Горизонтальная и вертикальная частоты радуги.
+ * @param phase Начальная фаза PI * (offX + 2 * (randomOffset + startColor) / RAND_MAX).
+ * @return Угол, определяющий положение символа на радуге.
+ */
+static inline float rainbowTheta(int column, int line, double freq_h, double freq_v, double phase) {
+    return column * freq_h / 5.0f + line * freq_v + phase;
+}
 
-    int hasColor = isatty(STDOUT_FILENO); // Флаг, указывающий на наличие цветного вывода
+#define RAINBOW_BATCH 64 // Количество столбцов, цвета которых вычисляются за раз
+#define RAINBOW_BACKSTEP 8 // Запас окна на столбцы левее текущего (wcwidth байтов UTF-8 равен -1)
+#define RAINBOW_SIN_LIMIT 1e6 // Предел |угла|, до которого приведение аргумента синуса точное
 
-    struct timeval timeVal; // Структура для хранения времени
-    gettimeofday(&timeVal, NULL); // Получение текущего времени
-    double offX = (timeVal.tv_sec % 300) / 300.0; // Отклонение по горизонтали
+// Выбор версии при запуске требует ifunc, а имя avx2 есть только у x86
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GLIBC__)
+#define RAINBOW_DISPATCH __attribute__((target_clones("avx2", "default")))
+#else
+#define RAINBOW_DISPATCH
+#endif
 
+typedef double v4d __attribute__((vector_size(32)));
+typedef long long v4l __attribute__((vector_size(32)));
 
-    int seed = time(NULL); // сид для генерации случайных чисел
-    int errCode = OK;
-    Flags flags = {false, true, false, false, false, false, false, false}; // Иницилизация структуры флагов
-    char *flagsString = ":h:v:s:g:flrobxi?"; // Строка с опциями командной строки
-    int flagSymbol;
+/**
+ * @brief Вычисляет синус четырех углов (приведение Коди - Уэйта и многочлены fdlibm, ошибка около 1 ulp).
+ *
+ * @param angles Углы, |x| <= RAINBOW_SIN_LIMIT.
+ * @param sines Указатель, куда будут записаны синусы.
+ */
+static inline __attribute__((always_inline)) void vectorSin(const v4d *angles, v4d *sines) {
+    v4d x = *angles;
+    // pi / 2 = pio2_1 + pio2_2 + pio2_2t, у первых двух частей 33 значащих бита, поэтому k * pio2 точно
+    const double invpio2 = 6.36619772367581382433e-01;
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_2 = 6.07710050630396597660e-11;
+    const double pio2_2t = 2.02226624879595063154e-21;
+    const double round = 0x1.8p52; // Прибавление округляет до целого, а младшие биты мантиссы хранят k
+
+    v4d t = x * invpio2 + round;
+    v4d k = t - round;
+    v4l quadrant = (v4l)t;
+    v4d r = x - k * pio2_1;
+
+    r = r - k * pio2_2;
+    r = r - k * pio2_2t;
+
+    v4d z = r * r;
+    v4d sinR = r + z * r *
+                       (-1.66666666666666324348e-01 +
+                        z * (8.33333333332248946124e-03 +
+                             z * (-1.98412698298579493134e-04 +
+                                  z * (2.75573137070700676789e-06 +
+                                       z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));
+    v4d half = 0.5 * z;
+    v4d w = 1.0 - half;
+    v4d cosR = w + (((1.0 - w) - half) +
+                    z * z *
+                        (4.16666666666666019037e-02 +
+                         z * (-1.38888888888741095749e-03 +
+                              z * (2.48015872894767294178e-05 +
+                                   z * (-2.75573143513906633035e-07 +
+                                        z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11))))));
+
+    // Четверть круга: 0 - sin r, 1 - cos r, 2 - -sin r, 3 - -cos r
+    v4l useSin = (quadrant & 1) == 0;
+    v4l result = ((v4l)sinR & useSin) | ((v4l)cosR & ~useSin);
+
+    *sines = (v4d)(result ^ ((quadrant & 2) << 62));
+}
 
-    struct option longFlags[] = {{"horizontal-frequency", 0, NULL, 'h'}, // Длинные опции командной строки
-                                 {"vertical-frequency", 0, NULL, 'v'},
-                                 {"force-color", 0, NULL, 'f'},
-                                 {"no-force-locale", 0, NULL, 'l'},
-                                 {"random", 0, NULL, 'r'},
-                                 {"seed", 0, NULL, 's'},
-                                 {"color_offset", 0, NULL, 'o'},
-                                 {"24bit", 0, NULL, 'b'},
-                                 {"16color", 0, NULL, 'x'},
-                                 {"invert", 0, NULL, 'i'},
-                                 {"gradient", 0, NULL, 'g'},
-                                 {"help", 0, NULL, '1'},
-                                 {NULL, 0, NULL, 0}};
+/**
+ * @brief Вычисляет цвета радуги режима --24bit для RAINBOW_BATCH углов сразу.
+ *
+ * Повторяет все операции rainbowColor в тех же типах, кроме синуса: он считается многочленом по четыре угла
+ * за раз. Синус отличается от библиотечного не больше чем на пару ulp double, а канал получается после
+ * округления до float и до целого, поэтому цвет совпадает с rainbowColor, кроме случаев, когда значение канала
+ * лежит в 1e-9 от середины между целыми: тогда канал может отличаться на 1.
+ *
+ * На x86 с glibc версия для процессора выбирается при запуске (target_clones через ifunc): AVX2 или общий
+ * вариант на SSE2. На остальных платформах собирается только общий вариант на векторах компилятора.
+ *
+ * @param theta Углы.
+ * @param colors Массив, куда будут записаны цвета.
+ */
+RAINBOW_DISPATCH void rainbowColors(const float *theta, union rgb_c *colors) {
+    const float offset = 0.1;
+    const double scale = 1.0f - offset;
 
-    // Обработка опций командной строки
-    while (((flagSymbol = getopt_long(argc, argv, flagsString, longFlags, NULL)) != -1)) {
-        errCode = initStruct(&flags, flagSymbol, &seed, &freq_h, &freq_v, &startColor, &rgb_start, &rgb_end);
-    }
+    for (int i = 0; i < RAINBOW_BATCH; i += 4) {
+        v4d x = {theta[i], theta[i + 1], theta[i + 2], theta[i + 3]};
+        v4d tooLarge = (v4d)((x > RAINBOW_SIN_LIMIT) | (x < -RAINBOW_SIN_LIMIT));
 
-    if (errCode != ERROR) {
-        // Проверка на одновременное указание опций --24bit и --16color
-        if (flags.b && flags.x) {
-            wprintf(L"Only one of --24bit and --16color can be given at a time\n");
-            exit(ERROR);
+        if (((v4l)tooLarge)[0] | ((v4l)tooLarge)[1] | ((v4l)tooLarge)[2] | ((v4l)tooLarge)[3]) {
+            for (int j = i; j < i + 4; ++j) {
+                rainbowColor(theta[j], &colors[j]);
+            }
+            continue;
         }
-    }
 
-    // обработка флага --help
-    if (flags.help) {
-        printf("%s", helpStr); // Вывод справки
-        return 0;
-    }
+        v4d angles[3] = {x, x + 2 * PI / 3, x + 4 * PI / 3};
+        v4d sines[3];
 
-    // Проверка флага --gradient
-    if (flags.g) {
-        // Проверка конфликтующего флага --16color
-        if (flags.x) {
-            wprintf(L"--gradient and --16color are mutually exclusive\n");
-            exit(2);
+        for (int channel = 0; channel < 3; ++channel) {
+            vectorSin(&angles[channel], &sines[channel]);
         }
 
-        // Если не указан флаг --24bit
-        if (!flags.b) {
-            size_t codesGradientSize = ARRAY_SIZE(codesGradient); // Размер массива цветов радуги
-            double correctionFactor = 2 * codesGradientSize / (double)ARRAY_SIZE(codes); // Корректировочный коэффициент для частот
-            freq_h *= correctionFactor; // Коррекция горизонтальной частоты
-            freq_v *= correctionFactor; // Коррекция вертикальной частоты
-
-            // Генерация цветов радуги
-            for (size_t i = 0; i < codesGradientSize; ++i) {
-                double factor = i / (double)(codesGradientSize - 1); // Фактор интерполяции
-                union rgb_c rgb_intermediate; // Промежуточный цвет в формате RGB
-                rgbInterpolate(&rgb_start, &rgb_end, &rgb_intermediate, factor); // Интерполяция цветов
-                codesGradient[i] = xterm256LookLike(&rgb_intermediate); // Определение ближайшего цвета из палитры xterm256
-            }
-        }
-    }
+        v4d r = (offset + scale * (0.5 + 0.5 * sines[0])) * 255.0;
+        v4d g = (offset + scale * (0.5 + 0.5 * sines[1])) * 255.0;
+        v4d b = (offset + scale * (0.5 + 0.5 * sines[2])) * 255.0;
 
-    // Обработка флага --invert
-    if (flags.i) {
-        if (flags.x) {
-            wprintf(L"\033[30m\n"); // Установка цвета фона
-        } else {
-            wprintf(L"\033[38;5;16m\n"); // Установка цвета текста
+        for (int j = 0; j < 4; ++j) {
+            colors[i + j].r = lrintf(r[j]);
+            colors[i + j].g = lrintf(g[j]);
+            colors[i + j].b = lrintf(b[j]);
         }
     }
+}
 
-    int randomOffset = 0; // Смещение для генерации случайных чисел
+/**
+ * Окно готовых управляющих последовательностей режима --24bit для соседних столбцов одной строки.
+ *
+ * line: Значение stringCount, для которого вычислено окно.
+ * first: Столбец первой последовательности.
+ * filled: Флаг, указывающий, что окно вычислено.
+ * escapes: Управляющие последовательности.
+ * lengths: Длины управляющих последовательностей.
+ */
+typedef struct {
+    int line;
+    int first;
+    int filled;
+    char escapes[RAINBOW_BATCH][GRADIENT_ESCAPE_SIZE];
+    unsigned char lengths[RAINBOW_BATCH];
+} RainbowWindow;
 
-    // Генерация случайного смещения, если указан флаг --random
-    if (flags.r) {
-        srand(seed);
-        randomOffset = rand();
+/**
+ * @brief Записывает число от 0 до 255 десятичными цифрами.
+ *
+ * @param dest Указатель на место для цифр.
+ * @param value Число.
+ * @return Указатель на место после цифр.
+ */
+static inline char *formatByte(char *dest, unsigned char value) {
+    if (value >= 100) {
+        *dest++ = '0' + value / 100;
     }
 
-    char **inputsBegin = argv + optind; // Указатель на начало аргументов командной строки
-    char **inputsEnd = argv + argc; // Указатель на конец аргументов командной строки
-
-    // Если нет переданных файлов в аргументах командной строки, используем стандартный ввод
-    if (inputsBegin == inputsEnd) {
-        inputsBegin = defaultArgv;
-        inputsEnd = inputsBegin + 1;
+    if (value >= 10) {
+        *dest++ = '0' + value / 10 % 10;
     }
 
-    char *envLang = getenv("LANG");  // return en_GB.UTF-8
+    *dest++ = '0' + value % 10;
 
-    // Установка локали
-    if (flags.l && envLang && !strstr(envLang, "UTF-8")) {
-        if (!setlocale(LC_ALL, "C.UTF-8")) {
-            setlocale(LC_ALL, ""); // Использование текущей локали
-        }
+    return dest;
+}
+
+/**
+ * @brief Вычисляет окно управляющих последовательностей режима --24bit вокруг столбца.
+ *
+ * @param window Указатель на окно.
+ * @param column Столбец, для которого нужна последовательность.
+ * @param line Значение stringCount.
+ * @param freq_h, freq_v Горизонтальная и вертикальная частоты радуги.
+ * @param phase Начальная фаза (см. rainbowTheta).
+ * @param invert Флаг --invert (цвет фона вместо цвета текста).
+ */
+void rainbowWindowFill(RainbowWindow *window, int column, int line, double freq_h, double freq_v, double phase,
+                       int invert) {
+    float theta[RAINBOW_BATCH];
+    union rgb_c colors[RAINBOW_BATCH];
+
+    // Строка из многобайтных символов идет влево, тогда окно целиком ставится левее столбца
+    if (window->filled && window->line == line && column < window->first) {
+        window->first = column - (RAINBOW_BATCH - 1 - RAINBOW_BACKSTEP);
     } else {
-        setlocale(LC_ALL, ""); // Использование текущей локали
+        window->first = column - RAINBOW_BACKSTEP;
     }
 
-    int charCountInStr = 0; // Счетчик символов в строке
-
-    // Чтение и обработка файлов
-    for (char **fileName = inputsBegin; fileName < inputsEnd; fileName++) {
-        FILE *filePtr;
-        int escapeState = NONE; // Состояние управляющей последовательности
-        char c; // Текущий символ
-
-        if (!strcmp(*fileName, "-")) {
-            filePtr = stdin; // Использование стандартного ввода
-        } else {
-            // Открытие файла для чтения
-            if ((filePtr = fopen(*fileName, "r")) == NULL) {
-                // Вывод сообщения об ошибке, если файл не удалось открыть
-                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *fileName, strerror(errno));
-                return ERROR;
-            }
-        }
+    window->line = line;
+    window->filled = true;
 
-        // Построчное чтение файла
-        while (fread(&c, 1, 1, filePtr) > 0) {
-            // Если включен цветной вывод
-            if (hasColor) {
-                // Обработка управляющих последовательностей
-                escapeState = findEscapeSequences(c, escapeState);
+    for (int i = 0; i < RAINBOW_BATCH; ++i) {
+        theta[i] = rainbowTheta(window->first + i, line, freq_h, freq_v, phase);
+    }
 
-                // Если необходимо вывести символ
-                if (escapeState == ESC_CSI_TERM) {
-                    putwchar(c);
-                }
+    rainbowColors(theta, colors);
 
-                // Если управляющая последовательность завершена
-                if (escapeState == NONE || escapeState == ESC_CSI_TERM) {
-                    if (c == '\n') {
-                        stringCount++; // Увеличение счетчика строк
-                        charCountInStr = 0; // Обнуление счетчика символов в строке
+    for (int i = 0; i < RAINBOW_BATCH; ++i) {
+        char *end = window->escapes[i];
 
-                        // Если включен флаг инверсии цвета
-                        if (flags.i) {
-                            wprintf(L"\033[49m"); // Установка цвета фона
-                        }
-                    } else {
-                        // Если управляющая последовательность завершена
-                        if (escapeState == NONE) {
-                            charCountInStr += wcwidth(c); // Увеличение счетчика символов в строке
-                        }
+        memcpy(end, invert ? "\033[48;2;" : "\033[38;2;", 7);
+        end = formatByte(end + 7, colors[i].r);
+        *end++ = ';';
+        end = formatByte(end, colors[i].g);
+        *end++ = ';';
+        end = formatByte(end, colors[i].b);
+        *end++ = 'm';
+        window->lengths[i] = end - window->escapes[i];
+    }
+}
 
-                        // Если включен флаг --24bit
-                        if (flags.b) {
-                            // Вычисление параметра угла
-                            float theta = charCountInStr * freq_h / 5.0f + stringCount * freq_v +
-                                          PI * (offX + 2.0f * (randomOffset + startColor) / (double)RAND_MAX);
+/**
+ * @brief Переводит угол режима --24bit в положение на градиенте: от начала к концу и обратно за 4 * PI.
+ *
+ * @param theta Угол, определяющий положение символа на градиенте.
+ * @return Положение на градиенте от 0 до 1.
+ */
+float gradientFactor(float theta) {
+    // Корректировка угла для градиента (ширина строки бывает отрицательной, а отражение симметрично)
+    theta = fabsf(fmodf(theta / 2.0f / PI, 2.0f));
 
-                            union rgb_c color;
+    // Если угол больше 1, отражаем его
+    if (theta > 1.0f) {
+        theta = 2.0f - theta;
+    }
 
-                            // Если включен флаг --gradient
-                            if (flags.g) {
-                                // Корректировка угла для градиента
-                                theta = fmodf(theta / 2.0f / PI, 2.0f);
+    return theta;
+}
 
-                                // Если угол больше 1, отражаем его
-                                if (theta > 1.0f) {
-                                    theta = 2.0f - theta;
-                                }
+/**
+ * @brief Переводит канал sRGB в линейную яркость.
+ *
+ * @param channel Значение канала от 0 до 255.
+ * @return Линейная яркость от 0 до 1.
+ */
+double srgbToLinear(double channel) {
+    channel /= 255.0;
+    return channel <= 0.04045 ? channel / 12.92 : pow((channel + 0.055) / 1.055, 2.4);
+}
 
-                                // Интерполяция цвета для градиента
-                                rgbInterpolate(&rgb_start, &rgb_end, &color, theta);
-                            } else {
-                                // Вычисление составляющих цвета для радуги
-                                float offset = 0.1;
-                                color.r =
-                                    lrintf((offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta))) * 255.0f);
-                                color.g = lrintf(
-                                    (offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta + 2 * PI / 3))) *
-                                    255.0f);
-                                color.b = lrintf(
-                                    (offset + (1.0f - offset) * (0.5f + 0.5f * sin(theta + 4 * PI / 3))) *
-                                    255.0f);
-                            }
+/**
+ * @brief Переводит линейную яркость в канал sRGB.
+ *
+ * @param value Линейная яркость.
+ * @return Значение канала от 0 до 255.
+ */
+unsigned char linearToSrgb(double value) {
+    value = value <= 0.0031308 ? 12.92 * value : 1.055 * pow(value, 1 / 2.4) - 0.055;
+    value = value * 255.0 + 0.5;
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
 
-                            // Вывод управляющей последовательности для цвета
-                            wprintf(L"\033[%d;2;%d;%d;%dm", (flags.i ? 48 : 38), color.r, color.g, color.b);
-                        // Если включен флаг --16color
-                        } else if (flags.x) {
-                            int newColorIndex = offX * ARRAY_SIZE(codes16) + (int)(charCountInStr * freq_h + stringCount * freq_v);
+/**
+ * @brief Переводит цвет в пространство OKLab.
+ *
+ * @param in Указатель на цвет в формате RGB.
+ * @param lab Массив для координат L, a, b.
+ */
+void rgbToOklab(const union rgb_c *in, double lab[3]) {
+    double r = srgbToLinear(in->r), g = srgbToLinear(in->g), b = srgbToLinear(in->b);
+    double l = cbrt(0.4122214708 * r + 0.5363325363 * g + 0.0514459929 * b);
+    double m = cbrt(0.2119034982 * r + 0.6806995451 * g + 0.1073969566 * b);
+    double s = cbrt(0.0883024619 * r + 0.2817188376 * g + 0.6299787005 * b);
+
+    lab[0] = 0.2104542553 * l + 0.7936177850 * m - 0.0040720468 * s;
+    lab[1] = 1.9779984951 * l - 2.4285922050 * m + 0.4505937099 * s;
+    lab[2] = 0.0259040371 * l + 0.7827717662 * m - 0.8086757660 * s;
+}
 
-                            if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
-                                wprintf(L"\033[%hhum", (flags.i ? 10 : 0) +
-                                                           codes16[(randomOffset + startColor + (colorIndex = newColorIndex)) %
-                                                                   ARRAY_SIZE(codes16)]);
-                            }
+/**
+ * @brief Переводит цвет из пространства OKLab в RGB.
+ *
+ * @param lab Координаты L, a, b.
+ * @param out Указатель на структуру rgb_c, куда будет записан цвет.
+ */
+void oklabToRgb(const double lab[3], union rgb_c *out) {
+    double l = lab[0] + 0.3963377774 * lab[1] + 0.2158037573 * lab[2];
+    double m = lab[0] - 0.1055613458 * lab[1] - 0.0638541728 * lab[2];
+    double s = lab[0] - 0.0894841775 * lab[1] - 1.2914855480 * lab[2];
+
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+
+    out->r = linearToSrgb(4.0767416621 * l - 3.3077115913 * m + 0.2309699292 * s);
+    out->g = linearToSrgb(-1.2684380046 * l + 2.6097574011 * m - 0.3413193965 * s);
+    out->b = linearToSrgb(-0.0041960863 * l - 0.7034186147 * m + 1.7076147010 * s);
+}
 
-                        } else {
-                            // Если включен флаг --gradient
-                            if (flags.g) {
-                                int newColorIndex = offX * ARRAY_SIZE(codesGradient) + (int)(charCountInStr * freq_h + stringCount * freq_v);
+/**
+ * @brief Вычисляет цвет в заданной точке градиента.
+ *
+ * @param gradient Указатель на градиент.
+ * @param factor Положение на градиенте от 0 (первый цвет) до 1 (последний цвет).
+ * @param out Указатель на структуру rgb_c, куда будет записан цвет.
+ */
+void gradientSample(const Gradient *gradient, double factor, union rgb_c *out) {
+    double position = factor * (gradient->count - 1);
+    int segment = position;
+
+    if (segment >= gradient->count - 1) {
+        segment = gradient->count - 2;
+    } else if (segment < 0) {
+        segment = 0;
+    }
 
-                                if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
-                                    size_t lookup = (randomOffset + startColor + (colorIndex = newColorIndex)) %
-                                                    (2 * ARRAY_SIZE(codesGradient));
+    union rgb_c start = gradient->stops[segment];
+    union rgb_c end = gradient->stops[segment + 1];
+    double local = position - segment;
 
-                                    if (lookup >= ARRAY_SIZE(codesGradient)) {
-                                        lookup = 2 * ARRAY_SIZE(codesGradient) - 1 - lookup;
-                                    }
+    if (gradient->oklab) {
+        double labStart[3], labEnd[3], lab[3];
 
-                                    // Вывод управляющей последовательности для цвета
-                                    wprintf(L"\033[%d;5;%hhum", (flags.i ? 48 : 38), codesGradient[lookup]);
-                                }
-                            } else {
-                                // Если не включен флаг --gradient
-                                int newColorIndex = offX * ARRAY_SIZE(codes) + (int)(stringCount * freq_h + stringCount * freq_v);
-                                if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
-                                    // Вывод управляющей последовательности для цвета
-                                    wprintf(
-                                        L"\033[%d;5;%hhum", (flags.i ? 48 : 38),
-                                        codes[(randomOffset + startColor + (colorIndex = newColorIndex)) % ARRAY_SIZE(codes)]);
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        rgbToOklab(&start, labStart);
+        rgbToOklab(&end, labEnd);
 
-            // Если управляющая последовательность завершена
-            if (escapeState != ESC_CSI_TERM) {
-                putwchar(c); // Вывод символа
-            }
+        for (int i = 0; i < 3; ++i) {
+            lab[i] = labStart[i] + (labEnd[i] - labStart[i]) * local;
         }
 
-        // Восстановление стандартного цвета после окончания обработки файла
-        if (hasColor) {
-            wprintf(L"\033[0m"); // Сброс цвета
-        }
+        oklabToRgb(lab, out);
+    } else {
+        rgbInterpolate(&start, &end, out, local);
+    }
+}
 
-        // Закрытие файла, если он был открыт
-        if (filePtr) {
-            // Если возникла ошибка при чтении файла
-            if (ferror(filePtr)) {
+/**
+ * Градиент, заранее разложенный в готовые управляющие последовательности для каждого режима вывода.
+ *
+ * escapes24, lengths24: GRADIENT_TABLE_SIZE последовательностей 24-битного режима для равномерных точек градиента.
+ * escapes256, lengths256: Последовательности режима 256 цветов для каждого элемента codesGradient.
+ */
+typedef struct {
+    char escapes24[GRADIENT_TABLE_SIZE][GRADIENT_ESCAPE_SIZE];
+    unsigned char lengths24[GRADIENT_TABLE_SIZE];
+    char escapes256[ARRAY_SIZE(codesGradient)][GRADIENT_ESCAPE_SIZE];
+    unsigned char lengths256[ARRAY_SIZE(codesGradient)];
+} GradientTables;
+
+/**
+ * @brief Раскладывает градиент в таблицы готовых управляющих последовательностей.
+ *
+ * @param gradient Указатель на градиент.
+ * @param tables Указатель на таблицы.
+ * @param invert Флаг --invert (цвет фона вместо цвета текста).
+ */
+void gradientCompile(const Gradient *gradient, GradientTables *tables, int invert) {
+    union rgb_c color;
+
+    for (size_t i = 0; i < GRADIENT_TABLE_SIZE; ++i) {
+        gradientSample(gradient, i / (double)(GRADIENT_TABLE_SIZE - 1), &color);
+        tables->lengths24[i] = snprintf(tables->escapes24[i], GRADIENT_ESCAPE_SIZE, "\033[%d;2;%d;%d;%dm",
+                                        (invert ? 48 : 38), color.r, color.g, color.b);
+    }
+
+    // Генерация цветов для режима 256 цветов
+    for (size_t i = 0; i < ARRAY_SIZE(codesGradient); ++i) {
+        gradientSample(gradient, i / (double)(ARRAY_SIZE(codesGradient) - 1), &color);
+        codesGradient[i] = xterm256LookLike(&color); // Определение ближайшего цвета из палитры xterm256
+        tables->lengths256[i] = snprintf(tables->escapes256[i], GRADIENT_ESCAPE_SIZE, "\033[%d;5;%um",
+                                         (invert ? 48 : 38), codesGradient[i]);
+    }
+}
+
+int wcwidth(wchar_t wc);
+
+#define LINE_INDEX_STRIDE 1024 // Через сколько строк индекс хранит контрольную точку
+#define LINE_INDEX_HEAD 4096 // Сколько первых байт файла хешируется для проверки индекса
+static const char lineIndexMagic[8] = "LOLIDX1";
+
+/**
+ * Позиция во входном файле в терминах счетчиков main().
+ *
+ * offset: Смещение в байтах от начала файла.
+ * lines: Значение stringCount в этой позиции.
+ * column: Значение charCountInStr в этой позиции.
+ * escapeState: Состояние автомата findEscapeSequences в этой позиции.
+ */
+typedef struct {
+    long long offset;
+    long long lines;
+    int column;
+    int escapeState;
+} LinePos;
+
+/**
+ * Индекс строк файла, который хранится рядом с ним в FILE.lolidx.
+ *
+ * Контрольная точка offsets[k] - смещение начала строки (k + 1) * LINE_INDEX_STRIDE (строки считаются
+ * от начала файла). Точки ставятся сразу после учтенного перевода строки, где автомат всегда
+ * находится в состоянии NONE, а ширина строки равна нулю, поэтому хранить их не нужно.
+ * tail - позиция в конце проиндексированной части, с нее индекс дополняется, когда файл растет.
+ * device, inode, headLen, headHash - признаки того, что индекс относится именно к этому файлу.
+ */
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t headLen;
+    uint64_t headHash;
+    LinePos tail;
+    long long *offsets;
+    size_t count;
+    size_t capacity;
+} LineIndex;
+
+/**
+ * @brief Считает хеш FNV-1a от блока байт.
+ *
+ * @param hash Значение хеша предыдущих блоков (14695981039346656037 для первого блока).
+ * @param data Указатель на блок.
+ * @param size Размер блока в байтах.
+ * @return Новое значение хеша.
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Обновляет позицию после одного прочитанного байта так же, как это делает основной цикл раскраски.
+ *
+ * @param pos Указатель на позицию.
+ * @param c Прочитанный байт.
+ * @return true, если байт оказался учтенным переводом строки.
+ */
+static inline int scanByte(LinePos *pos, char c) {
+    pos->offset++;
+    pos->escapeState = findEscapeSequences(c, pos->escapeState);
+
+    if (pos->escapeState != NONE && pos->escapeState != ESC_CSI_TERM) {
+        return false;
+    }
+
+    if (c == '\n') {
+        pos->lines++;
+        pos->column = 0;
+        return true;
+    }
+
+    if (pos->escapeState == NONE) {
+        pos->column += wcwidth(c);
+    }
+
+    return false;
+}
+
+/**
+ * @brief Прогоняет файл через автомат escape-последовательностей без вывода, обновляя счетчики так же,
+ * как это делает основной цикл раскраски.
+ *
+ * Останавливается сразу после перевода строки, на котором pos->lines достигает targetLines, или в конце файла.
+ *
+ * @param filePtr Файл, текущая позиция которого совпадает с pos->offset.
+ * @param pos Указатель на позицию, которая обновляется по мере чтения.
+ * @param targetLines Значение stringCount, до которого нужно дочитать.
+ * @param index Указатель на индекс, в который добавляются контрольные точки, или NULL.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int scanLines(FILE *filePtr, LinePos *pos, long long targetLines, LineIndex *index) {
+    int ch;
+
+    while (pos->lines < targetLines && (ch = getc_unlocked(filePtr)) != EOF) {
+        if (scanByte(pos, ch) && index && pos->lines % LINE_INDEX_STRIDE == 0) {
+            if (index->count == index->capacity) {
+                index->capacity = index->capacity ? 2 * index->capacity : 64;
+                index->offsets = realloc(index->offsets, index->capacity * sizeof(*index->offsets));
+
+                if (!index->offsets) {
+                    return ERROR;
+                }
+            }
+
+            index->offsets[index->count++] = pos->offset;
+        }
+    }
+
+    return ferror(filePtr) ? ERROR : OK;
+}
+
+/**
+ * @brief Дочитывает файл до конца, обновляя счетчики так же, как scanLines.
+ *
+ * Читает файл блоками: в блоке без ESC счетчик строк увеличивается поиском переводов строк через memchr,
+ * а ширина считается только у хвоста после последнего из них. Остальные блоки проходят через автомат побайтно.
+ *
+ * @param filePtr Файл, текущая позиция которого совпадает с pos->offset.
+ * @param pos Указатель на позицию, которая обновляется по мере чтения.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int countLines(FILE *filePtr, LinePos *pos) {
+    char block[65536];
+    size_t size;
+
+    while ((size = fread(block, 1, sizeof(block), filePtr)) > 0) {
+        const char *end = block + size;
+
+        if (pos->escapeState != NONE || memchr(block, '\033', size)) {
+            for (const char *p = block; p < end; ++p) {
+                scanByte(pos, *p);
+            }
+            continue;
+        }
+
+        const char *lineStart = block;
+
+        for (const char *p; (p = memchr(lineStart, '\n', end - lineStart)); lineStart = p + 1) {
+            pos->lines++;
+        }
+
+        if (lineStart != block) {
+            pos->column = 0;
+        }
+
+        for (const char *p = lineStart; p < end; ++p) {
+            pos->column += wcwidth(*p);
+        }
+
+        pos->offset += size;
+    }
+
+    return ferror(filePtr) ? ERROR : OK;
+}
+
+/**
+ * @brief Считает хеш первых headLen байт файла, не меняя его текущую позицию чтения.
+ *
+ * @param fd Дескриптор файла.
+ * @param headLen Количество байт.
+ * @param hash Указатель на переменную для результата.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int hashFileHead(int fd, uint64_t headLen, uint64_t *hash) {
+    char head[LINE_INDEX_HEAD];
+
+    if (headLen > sizeof(head) || pread(fd, head, headLen, 0) != (ssize_t)headLen) {
+        return ERROR;
+    }
+
+    *hash = fnv1a(14695981039346656037ULL, head, headLen);
+    return OK;
+}
+
+/**
+ * @brief Загружает индекс строк из файла indexName, если он соответствует файлу с описанием fileStat.
+ *
+ * @param indexName Путь к файлу индекса.
+ * @param fd Дескриптор индексируемого файла.
+ * @param fileStat Результат fstat для индексируемого файла.
+ * @param index Указатель на пустой индекс, который заполняется при успехе.
+ * @return OK, если индекс загружен и годится для продолжения, иначе ERROR.
+ */
+int loadLineIndex(const char *indexName, int fd, struct stat *fileStat, LineIndex *index) {
+    FILE *indexPtr = fopen(indexName, "rb");
+    char magic[sizeof(lineIndexMagic)];
+    uint64_t headHash;
+    uint64_t count;
+
+    if (!indexPtr) {
+        return ERROR;
+    }
+
+    int ok = fread(magic, sizeof(magic), 1, indexPtr) == 1 && !memcmp(magic, lineIndexMagic, sizeof(magic)) &&
+             fread(&index->device, sizeof(index->device), 1, indexPtr) == 1 &&
+             fread(&index->inode, sizeof(index->inode), 1, indexPtr) == 1 &&
+             fread(&index->headLen, sizeof(index->headLen), 1, indexPtr) == 1 &&
+             fread(&index->headHash, sizeof(index->headHash), 1, indexPtr) == 1 &&
+             fread(&index->tail, sizeof(index->tail), 1, indexPtr) == 1 &&
+             fread(&count, sizeof(count), 1, indexPtr) == 1;
+
+    // Файл подменили, обрезали или переписали: индекс придется строить заново
+    ok = ok && index->device == (uint64_t)fileStat->st_dev && index->inode == (uint64_t)fileStat->st_ino &&
+         index->tail.offset <= fileStat->st_size && index->headLen <= (uint64_t)index->tail.offset &&
+         hashFileHead(fd, index->headLen, &headHash) == OK && headHash == index->headHash &&
+         count == (uint64_t)(index->tail.lines / LINE_INDEX_STRIDE);
+
+    if (ok) {
+        index->count = index->capacity = count;
+        index->offsets = malloc((count ? count : 1) * sizeof(*index->offsets));
+        ok = index->offsets && fread(index->offsets, sizeof(*index->offsets), count, indexPtr) == count;
+    }
+
+    fclose(indexPtr);
+
+    if (!ok) {
+        free(index->offsets);
+        memset(index, 0, sizeof(*index));
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/**
+ * @brief Атомарно сохраняет индекс строк в файл indexName (через временный файл и rename).
+ *
+ * @param indexName Путь к файлу индекса.
+ * @param index Указатель на индекс.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int saveLineIndex(const char *indexName, LineIndex *index) {
+    char tmpName[PATH_MAX];
+    uint64_t count = index->count;
+
+    if (snprintf(tmpName, sizeof(tmpName), "%s.%ld", indexName, (long)getpid()) >= (int)sizeof(tmpName)) {
+        return ERROR;
+    }
+
+    FILE *indexPtr = fopen(tmpName, "wb");
+
+    if (!indexPtr) {
+        return ERROR;
+    }
+
+    int ok = fwrite(lineIndexMagic, sizeof(lineIndexMagic), 1, indexPtr) == 1 &&
+             fwrite(&index->device, sizeof(index->device), 1, indexPtr) == 1 &&
+             fwrite(&index->inode, sizeof(index->inode), 1, indexPtr) == 1 &&
+             fwrite(&index->headLen, sizeof(index->headLen), 1, indexPtr) == 1 &&
+             fwrite(&index->headHash, sizeof(index->headHash), 1, indexPtr) == 1 &&
+             fwrite(&index->tail, sizeof(index->tail), 1, indexPtr) == 1 &&
+             fwrite(&count, sizeof(count), 1, indexPtr) == 1 &&
+             fwrite(index->offsets, sizeof(*index->offsets), index->count, indexPtr) == index->count;
+
+    if (fclose(indexPtr) || !ok || rename(tmpName, indexName)) {
+        remove(tmpName);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/**
+ * @brief Загружает индекс строк файла и дочитывает в него часть файла, дописанную после его построения.
+ * Если сохраненный индекс отсутствует или устарел, строит его с нуля.
+ *
+ * @param filePtr Индексируемый файл (обычный файл, позиция чтения после вызова не определена).
+ * @param fileName Имя индексируемого файла.
+ * @param index Указатель на пустой индекс, который заполняется при успехе.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int updateLineIndex(FILE *filePtr, const char *fileName, LineIndex *index) {
+    char indexName[PATH_MAX];
+    struct stat fileStat;
+    int fd = fileno(filePtr);
+
+    if (fstat(fd, &fileStat) || !S_ISREG(fileStat.st_mode) ||
+        snprintf(indexName, sizeof(indexName), "%s.lolidx", fileName) >= (int)sizeof(indexName)) {
+        return ERROR;
+    }
+
+    if (loadLineIndex(indexName, fd, &fileStat, index) == OK && index->tail.offset == fileStat.st_size) {
+        return OK;
+    }
+
+    if (!index->offsets) {
+        index->device = fileStat.st_dev;
+        index->inode = fileStat.st_ino;
+        index->headLen = fileStat.st_size < LINE_INDEX_HEAD ? fileStat.st_size : LINE_INDEX_HEAD;
+
+        if (hashFileHead(fd, index->headLen, &index->headHash) != OK) {
+            return ERROR;
+        }
+    }
+
+    // Дочитываем только то, что появилось в файле с прошлого раза
+    if (fseeko(filePtr, index->tail.offset, SEEK_SET) || scanLines(filePtr, &index->tail, LLONG_MAX, index) != OK) {
+        free(index->offsets);
+        memset(index, 0, sizeof(*index));
+        return ERROR;
+    }
+
+    if (saveLineIndex(indexName, index) != OK) {
+        fwprintf(stderr, L"Cannot write line index \"%s\": %s\n", indexName, strerror(errno));
+    }
+
+    return OK;
+}
+
+/**
+ * @brief Пропускает начало файла до строки targetLines для опции --lines.
+ *
+ * С индексом переходит к ближайшей контрольной точке через fseeko и дочитывает не больше
+ * LINE_INDEX_STRIDE строк, без индекса (или для stdin и каналов) просто дочитывает файл до нужной строки.
+ *
+ * @param filePtr Файл, открытый с начала.
+ * @param fileName Имя файла.
+ * @param pos Указатель на позицию: на входе - счетчики main() в начале файла, на выходе - в начале строки
+ *            targetLines (или в конце файла, если он закончился раньше).
+ * @param targetLines Значение stringCount, с которого начинается вывод.
+ * @param useIndex Использовать ли индекс FILE.lolidx.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int seekToLine(FILE *filePtr, const char *fileName, LinePos *pos, long long targetLines, int useIndex) {
+    LineIndex index = {0};
+
+    if (useIndex && filePtr != stdin && updateLineIndex(filePtr, fileName, &index) == OK) {
+        size_t checkpoint = (targetLines - pos->lines) / LINE_INDEX_STRIDE;
+
+        if (checkpoint > index.count) {
+            checkpoint = index.count;
+        }
+
+        // Смещение и счетчики индекса отсчитываются от начала файла
+        if (checkpoint > 0) {
+            pos->offset = index.offsets[checkpoint - 1];
+            pos->lines += checkpoint * LINE_INDEX_STRIDE;
+            pos->column = 0;
+            pos->escapeState = NONE;
+        }
+
+        free(index.offsets);
+
+        if (fseeko(filePtr, pos->offset, SEEK_SET)) {
+            return ERROR;
+        }
+    } else if (useIndex && filePtr != stdin) {
+        // Индекс мог успеть прочитать часть файла до ошибки
+        fseeko(filePtr, pos->offset, SEEK_SET);
+    }
+
+    return scanLines(filePtr, pos, targetLines, NULL);
+}
+
+#define OUTPUT_BUFFER_SIZE 65536 // Размер буфера вывода
+#define OUTPUT_ESCAPE_MAX 64 // Максимальная длина одной управляющей последовательности
+
+#define ADAPTIVE_STEPS 64 // Количество оттенков на период радуги в грубых режимах --adaptive
+#define ADAPTIVE_WINDOW 16 // Количество сбросов буфера, по которым оценивается нагрузка
+#define ADAPTIVE_BLOCKED_HIGH 0.5 // Доля времени окна в блокировке write, при которой качество понижается
+#define ADAPTIVE_BLOCKED_LOW 0.1 // Доля времени окна в блокировке write, ниже которой окно считается спокойным
+#define ADAPTIVE_TTY_QUEUE 4096 // Заполненность очереди терминала (в байтах), считающаяся задержкой
+#define ADAPTIVE_CALM_WINDOWS 2 // Сколько спокойных окон подряд нужно для повышения качества
+
+// QUALITY_24BIT: Отдельный 24-битный цвет для каждого символа.
+// QUALITY_24BIT_RUNS: 24-битный цвет, который меняется только при смене одного из ADAPTIVE_STEPS оттенков.
+// QUALITY_256: Цвет из палитры xterm256.
+// QUALITY_16: Цвет из 16 стандартных цветов.
+enum quality { QUALITY_24BIT = 0, QUALITY_24BIT_RUNS, QUALITY_256, QUALITY_16, QUALITY_COUNT };
+
+/**
+ * Состояние опции --adaptive.
+ *
+ * level: Текущее качество вывода (enum quality).
+ * bestLevel, worstLevel: Границы, в которых может меняться качество.
+ * calmCount: Количество спокойных окон подряд.
+ * flushes: Количество сбросов в текущем окне.
+ * congested: Количество сбросов в текущем окне, к началу которых очередь вывода была переполнена.
+ * blocked: Время, проведенное в write в текущем окне (в секундах).
+ * windowStart: Время начала текущего окна.
+ * changed: Флаг, указывающий, что качество изменилось и цвет нужно вывести заново.
+ * queueKind: Способ узнать заполненность очереди вывода (0 - никак, 1 - TIOCOUTQ, 2 - FIONREAD для канала).
+ * queueLimit: Заполненность очереди в байтах, начиная с которой вывод считается перегруженным.
+ * rgb, codes256, codes16: Оттенки одного периода радуги (или градиента) в каждом из грубых режимов --24bit.
+ * codes16ForCodes: Ближайший из 16 цветов для каждого цвета codes (грубый режим вывода в 256 цветах).
+ */
+typedef struct {
+    int level;
+    int bestLevel;
+    int worstLevel;
+    int calmCount;
+    int flushes;
+    int congested;
+    double blocked;
+    struct timespec windowStart;
+    int changed;
+    int queueKind;
+    int queueLimit;
+    union rgb_c rgb[ADAPTIVE_STEPS];
+    unsigned char codes256[ADAPTIVE_STEPS];
+    unsigned char codes16[ADAPTIVE_STEPS];
+    unsigned char codes16ForCodes[ARRAY_SIZE(codes)];
+} Adaptive;
+
+#define COMPRESS_CHUNK_SIZE 1048576 // Размер буфера вывода при --compress, каждый буфер сжимается отдельно
+
+/**
+ * Состояние опции --compress: поток, который сжимает заполненные буферы вывода и пишет их в дескриптор.
+ *
+ * Каждый буфер становится отдельным членом gzip или кадром zstd, поэтому оборванный файл читается
+ * до последнего записанного буфера, а gzip -d и zstd -d принимают склеенные члены и кадры.
+ *
+ * kind: Формат (enum compression).
+ * fd: Дескриптор, в который пишется сжатый вывод.
+ * thread: Поток сжатия.
+ * mutex, cond: Синхронизация с основным потоком.
+ * chunk, chunkLen: Буфер, переданный потоку, и его длина.
+ * spare: Второй буфер, который основной поток заполняет, пока сжимается chunk.
+ * busy: Флаг, указывающий, что поток сжимает chunk.
+ * done: Флаг, указывающий, что больше буферов не будет.
+ * submitted: Флаг, указывающий, что потоку передан хотя бы один буфер.
+ * error: Код ошибки записи (0 - ошибок нет).
+ * packed, packedCapacity: Буфер сжатых данных.
+ * gzip, zstd: Состояния библиотек сжатия.
+ */
+typedef struct {
+    int kind;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *chunk;
+    size_t chunkLen;
+    char *spare;
+    int busy;
+    int done;
+    int submitted;
+    int error;
+    char *packed;
+    size_t packedCapacity;
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} Compressor;
+
+/**
+ * Буфер вывода поверх файлового дескриптора или в памяти.
+ *
+ * fd: Дескриптор, в который сбрасывается буфер (-1 - буфер в памяти, который растет вместо сброса).
+ * lineBuffered: Флаг, указывающий, что буфер сбрасывается после каждого перевода строки (вывод в терминал).
+ * adaptive: Указатель на состояние --adaptive, которое обновляется после каждого сброса, или NULL.
+ * compressor: Указатель на состояние --compress, которому передается буфер при сбросе, или NULL.
+ * len: Количество байт в буфере.
+ * capacity: Размер буфера.
+ * data: Буфер.
+ */
+typedef struct {
+    int fd;
+    int lineBuffered;
+    Adaptive *adaptive;
+    Compressor *compressor;
+    size_t len;
+    size_t capacity;
+    char *data;
+} Output;
+
+// Цвета 16-цветного режима в палитре xterm по умолчанию, в том же порядке, что и codes16
+const union rgb_c codes16Palette[] = {{{205, 0, 0}},   {{205, 205, 0}}, {{0, 205, 0}},   {{0, 205, 205}},
+                                      {{0, 0, 238}},   {{205, 0, 205}}, {{255, 0, 255}}, {{92, 92, 255}},
+                                      {{0, 255, 255}}, {{0, 255, 0}},   {{255, 255, 0}}, {{255, 0, 0}}};
+
+/**
+ * @brief Находит ближайший цвет среди 16 стандартных цветов.
+ *
+ * @param color Указатель на цвет.
+ * @return Код цвета из codes16.
+ */
+unsigned char codes16LookLike(const union rgb_c *color) {
+    int minDiff = INT_MAX;
+    unsigned char code = codes16[0];
+
+    for (size_t j = 0; j < ARRAY_SIZE(codes16Palette); ++j) {
+        int diffR = color->r - codes16Palette[j].r;
+        int diffG = color->g - codes16Palette[j].g;
+        int diffB = color->b - codes16Palette[j].b;
+        int diff = diffR * diffR + diffG * diffG + diffB * diffB;
+
+        if (diff < minDiff) {
+            minDiff = diff;
+            code = codes16[j];
+        }
+    }
+
+    return code;
+}
+
+/**
+ * @brief Подготавливает состояние --adaptive: таблицы оттенков и способ измерения очереди вывода.
+ *
+ * @param adaptive Указатель на состояние.
+ * @param flags Указатель на структуру флагов.
+ * @param fd Дескриптор вывода.
+ * @param gradient Указатель на градиент.
+ */
+void adaptiveInit(Adaptive *adaptive, Flags *flags, int fd, const Gradient *gradient) {
+    struct stat fdStat;
+
+    adaptive->bestLevel = flags->b ? QUALITY_24BIT : (flags->x ? QUALITY_16 : QUALITY_256);
+    adaptive->worstLevel = flags->g ? QUALITY_256 : QUALITY_16; // Градиент не выводится в 16 цветах
+    adaptive->level = adaptive->bestLevel;
+    adaptive->calmCount = 0;
+    adaptive->flushes = 0;
+    adaptive->congested = 0;
+    adaptive->blocked = 0;
+    clock_gettime(CLOCK_MONOTONIC, &adaptive->windowStart);
+    adaptive->changed = false;
+    adaptive->queueKind = 0;
+    adaptive->queueLimit = 0;
+
+#ifdef TIOCOUTQ
+    if (isatty(fd)) {
+        adaptive->queueKind = 1;
+        adaptive->queueLimit = ADAPTIVE_TTY_QUEUE;
+    } else if (!fstat(fd, &fdStat) && S_ISSOCK(fdStat.st_mode)) {
+        adaptive->queueKind = 1;
+        adaptive->queueLimit = OUTPUT_BUFFER_SIZE;
+    }
+#endif
+#if defined(FIONREAD) && defined(F_GETPIPE_SZ)
+    if (!adaptive->queueKind && !fstat(fd, &fdStat) && S_ISFIFO(fdStat.st_mode)) {
+        // Канал считается перегруженным, когда читатель не забрал больше половины его емкости
+        int pipeSize = fcntl(fd, F_GETPIPE_SZ);
+
+        if (pipeSize > 0) {
+            adaptive->queueKind = 2;
+            adaptive->queueLimit = pipeSize / 2;
+        }
+    }
+#endif
+    (void)fdStat;
+
+    for (int i = 0; i < ADAPTIVE_STEPS; ++i) {
+        double phase = (i + 0.5) / ADAPTIVE_STEPS;
+
+        if (flags->g) {
+            // Период градиента - 4 * PI: от начального цвета к конечному и обратно
+            gradientSample(gradient, phase < 0.5 ? 2 * phase : 2 - 2 * phase, &adaptive->rgb[i]);
+        } else {
+            rainbowColor(2 * PI * phase, &adaptive->rgb[i]);
+        }
+
+        adaptive->codes256[i] = xterm256LookLike(&adaptive->rgb[i]);
+        adaptive->codes16[i] = codes16LookLike(&adaptive->rgb[i]);
+    }
+
+    // Режим 256 цветов переходит в 16 цветов по тем же номерам в codes, поэтому радуга не прыгает
+    for (size_t i = 0; i < ARRAY_SIZE(codes); ++i) {
+        adaptive->codes16ForCodes[i] = codes16LookLike(&xterm256Palette[codes[i] - 0x10]);
+    }
+}
+
+/**
+ * @brief Возвращает количество байт в очереди вывода, которые потребитель еще не забрал.
+ *
+ * @param adaptive Указатель на состояние.
+ * @param fd Дескриптор вывода.
+ * @return Количество байт (0, если заполненность очереди узнать нельзя).
+ */
+int adaptiveQueued(Adaptive *adaptive, int fd) {
+    int queued = 0;
+
+#ifdef TIOCOUTQ
+    if (adaptive->queueKind == 1 && ioctl(fd, TIOCOUTQ, &queued)) {
+        queued = 0;
+    }
+#endif
+#ifdef FIONREAD
+    if (adaptive->queueKind == 2 && ioctl(fd, FIONREAD, &queued)) {
+        queued = 0;
+    }
+#endif
+
+    return queued;
+}
+
+/**
+ * @brief Меняет качество вывода по результатам очередного сброса буфера.
+ *
+ * Нагрузка оценивается по окну из ADAPTIVE_WINDOW сбросов, а не по одному write: сброс размером с канал
+ * блокируется, пока читатель не получит процессор, даже если читатель быстрый. Если заполненность очереди
+ * вывода известна, качество понижается, когда очередь была переполнена перед большинством сбросов окна и write
+ * занял больше ADAPTIVE_BLOCKED_LOW времени, а окно спокойно, когда очередь была переполнена не больше чем перед
+ * четвертью сбросов. Иначе качество понижается, когда write занял больше ADAPTIVE_BLOCKED_HIGH времени окна,
+ * а окно спокойно, когда меньше ADAPTIVE_BLOCKED_LOW. Качество повышается на одну ступень после
+ * ADAPTIVE_CALM_WINDOWS спокойных окон подряд.
+ *
+ * @param adaptive Указатель на состояние.
+ * @param queued Заполненность очереди вывода перед сбросом (в байтах).
+ * @param stall Время, проведенное в write при сбросе (в секундах).
+ */
+void adaptiveUpdate(Adaptive *adaptive, int queued, double stall) {
+    int oldLevel = adaptive->level;
+    struct timespec now;
+
+    adaptive->blocked += stall;
+    adaptive->congested += adaptive->queueKind && queued > adaptive->queueLimit;
+
+    if (++adaptive->flushes < ADAPTIVE_WINDOW) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double wall = (now.tv_sec - adaptive->windowStart.tv_sec) + (now.tv_nsec - adaptive->windowStart.tv_nsec) / 1e9;
+    double share = wall > 0 ? adaptive->blocked / wall : 0;
+
+    int pressure, calm;
+
+    if (adaptive->queueKind) {
+        // На одном процессоре в блокировку попадает и работа быстрого читателя, а очередь перед сбросом
+        // остается переполненной, только если читатель действительно не успевает
+        pressure = 2 * adaptive->congested > adaptive->flushes && share > ADAPTIVE_BLOCKED_LOW;
+        calm = 4 * adaptive->congested <= adaptive->flushes;
+    } else {
+        pressure = share > ADAPTIVE_BLOCKED_HIGH;
+        calm = share < ADAPTIVE_BLOCKED_LOW;
+    }
+
+    if (pressure) {
+        adaptive->calmCount = 0;
+
+        if (adaptive->level < adaptive->worstLevel) {
+            adaptive->level++;
+        }
+    } else if (!calm) {
+        adaptive->calmCount = 0;
+    } else if (++adaptive->calmCount >= ADAPTIVE_CALM_WINDOWS) {
+        adaptive->calmCount = 0;
+
+        if (adaptive->level > adaptive->bestLevel) {
+            adaptive->level--;
+        }
+    }
+
+    adaptive->flushes = 0;
+    adaptive->congested = 0;
+    adaptive->blocked = 0;
+    adaptive->windowStart = now;
+
+    if (adaptive->level != oldLevel) {
+        adaptive->changed = true;
+    }
+}
+
+/**
+ * @brief Возвращает номер оттенка из таблиц --adaptive для заданного угла.
+ *
+ * @param theta Угол, вычисленный так же, как для режима --24bit.
+ * @param gradient Флаг --gradient (период градиента вдвое длиннее периода радуги).
+ * @return Номер оттенка от 0 до ADAPTIVE_STEPS - 1.
+ */
+int adaptiveStep(float theta, int gradient) {
+    double phase = theta / ((gradient ? 4 : 2) * PI);
+    int step = (phase - floor(phase)) * ADAPTIVE_STEPS;
+
+    return step < ADAPTIVE_STEPS ? step : ADAPTIVE_STEPS - 1;
+}
+
+/**
+ * @brief Записывает блок байт в дескриптор целиком.
+ *
+ * @param fd Дескриптор.
+ * @param data Указатель на блок.
+ * @param size Размер блока в байтах.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка записи).
+ */
+int writeAll(int fd, const char *data, size_t size) {
+    size_t written = 0;
+
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return ERROR;
+        }
+
+        written += n;
+    }
+
+    return OK;
+}
+
+/**
+ * @brief Сжимает один буфер в отдельный член gzip или кадр zstd.
+ *
+ * @param compressor Указатель на состояние --compress.
+ * @param data Указатель на буфер.
+ * @param size Размер буфера в байтах.
+ * @return Размер сжатых данных в compressor->packed (0 - ошибка сжатия).
+ */
+size_t compressChunk(Compressor *compressor, const char *data, size_t size) {
+#ifdef HAVE_ZLIB
+    if (compressor->kind == COMPRESS_GZIP) {
+        z_stream *stream = &compressor->gzip;
+
+        // Буфер packed не меньше deflateBound, поэтому хватает одного вызова deflate
+        stream->next_in = (Bytef *)data;
+        stream->avail_in = size;
+        stream->next_out = (Bytef *)compressor->packed;
+        stream->avail_out = compressor->packedCapacity;
+
+        int status = deflate(stream, Z_FINISH);
+        size_t packedLen = compressor->packedCapacity - stream->avail_out;
+
+        deflateReset(stream);
+        return status == Z_STREAM_END ? packedLen : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compressor->kind == COMPRESS_ZSTD) {
+        size_t packedLen = ZSTD_compress2(compressor->zstd, compressor->packed, compressor->packedCapacity, data, size);
+
+        return ZSTD_isError(packedLen) ? 0 : packedLen;
+    }
+#endif
+    (void)compressor;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+/**
+ * @brief Поток опции --compress: сжимает переданные буферы и пишет их в дескриптор.
+ *
+ * @param arg Указатель на состояние --compress.
+ * @return NULL.
+ */
+void *compressorThread(void *arg) {
+    Compressor *compressor = arg;
+
+    pthread_mutex_lock(&compressor->mutex);
+
+    for (;;) {
+        while (!compressor->busy && !compressor->done) {
+            pthread_cond_wait(&compressor->cond, &compressor->mutex);
+        }
+
+        if (!compressor->busy) {
+            break;
+        }
+
+        pthread_mutex_unlock(&compressor->mutex);
+
+        size_t packedLen = compressChunk(compressor, compressor->chunk, compressor->chunkLen);
+        int error = 0;
+
+        if (!packedLen) {
+            error = ENOMEM;
+        } else if (writeAll(compressor->fd, compressor->packed, packedLen) != OK) {
+            error = errno;
+        }
+
+        pthread_mutex_lock(&compressor->mutex);
+
+        if (error && !compressor->error) {
+            compressor->error = error;
+        }
+
+        compressor->busy = false;
+        pthread_cond_broadcast(&compressor->cond);
+    }
+
+    pthread_mutex_unlock(&compressor->mutex);
+
+    return NULL;
+}
+
+/**
+ * @brief Запускает поток опции --compress и подключает его к буферу вывода.
+ *
+ * @param compressor Указатель на состояние --compress.
+ * @param out Указатель на буфер вывода (его буфер заменяется на буфер размера COMPRESS_CHUNK_SIZE).
+ * @param kind Формат (enum compression).
+ */
+void compressorStart(Compressor *compressor, Output *out, int kind) {
+    memset(compressor, 0, sizeof(*compressor));
+    compressor->kind = kind;
+    compressor->fd = out->fd;
+    compressor->packedCapacity = COMPRESS_CHUNK_SIZE;
+
+#ifdef HAVE_ZLIB
+    if (kind == COMPRESS_GZIP) {
+        // 15 + 16: окно 32 КиБ и заголовок gzip вместо zlib
+        if (deflateInit2(&compressor->gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+
+        compressor->packedCapacity = deflateBound(&compressor->gzip, COMPRESS_CHUNK_SIZE);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (kind == COMPRESS_ZSTD) {
+        compressor->zstd = ZSTD_createCCtx();
+
+        if (!compressor->zstd) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+
+        // Уровень сжатия по умолчанию, контрольная сумма в каждом кадре, как у утилиты zstd
+        ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_checksumFlag, 1);
+        compressor->packedCapacity = ZSTD_compressBound(COMPRESS_CHUNK_SIZE);
+    }
+#endif
+
+    char *data = malloc(COMPRESS_CHUNK_SIZE);
+
+    compressor->spare = malloc(COMPRESS_CHUNK_SIZE);
+    compressor->packed = malloc(compressor->packedCapacity);
+
+    if (!data || !compressor->spare || !compressor->packed) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(ERROR);
+    }
+
+    pthread_mutex_init(&compressor->mutex, NULL);
+    pthread_cond_init(&compressor->cond, NULL);
+
+    int error = pthread_create(&compressor->thread, NULL, compressorThread, compressor);
+
+    if (error) {
+        fwprintf(stderr, L"Cannot create threads: %s\n", strerror(error));
+        exit(ERROR);
+    }
+
+    // Поток сжатия сам решает, когда писать, построчный сброс дал бы крошечные кадры
+    out->compressor = compressor;
+    out->lineBuffered = false;
+    out->len = 0;
+    out->capacity = COMPRESS_CHUNK_SIZE;
+    out->data = data;
+}
+
+/**
+ * @brief Передает заполненный буфер потоку сжатия, дождавшись, пока освободится второй буфер.
+ *
+ * @param compressor Указатель на состояние --compress.
+ * @param data Указатель на заполненный буфер.
+ * @param size Количество байт в буфере.
+ * @return Указатель на свободный буфер для дальнейшего вывода.
+ */
+char *compressorSubmit(Compressor *compressor, char *data, size_t size) {
+    pthread_mutex_lock(&compressor->mutex);
+
+    while (compressor->busy) {
+        pthread_cond_wait(&compressor->cond, &compressor->mutex);
+    }
+
+    char *spare = compressor->spare;
+
+    compressor->chunk = data;
+    compressor->chunkLen = size;
+    compressor->spare = data; // Освободится, когда поток снимет busy
+    compressor->busy = true;
+    compressor->submitted = true;
+    pthread_cond_broadcast(&compressor->cond);
+    pthread_mutex_unlock(&compressor->mutex);
+
+    return spare;
+}
+
+/**
+ * @brief Дожидается сжатия последнего буфера и останавливает поток опции --compress.
+ *
+ * @param compressor Указатель на состояние --compress.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка сжатия или записи, см. errno).
+ */
+int compressorFinish(Compressor *compressor) {
+    pthread_mutex_lock(&compressor->mutex);
+    compressor->done = true;
+    pthread_cond_broadcast(&compressor->cond);
+    pthread_mutex_unlock(&compressor->mutex);
+    pthread_join(compressor->thread, NULL);
+
+#ifdef HAVE_ZLIB
+    if (compressor->kind == COMPRESS_GZIP) {
+        deflateEnd(&compressor->gzip);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compressor->kind == COMPRESS_ZSTD) {
+        ZSTD_freeCCtx(compressor->zstd);
+    }
+#endif
+
+    pthread_mutex_destroy(&compressor->mutex);
+    pthread_cond_destroy(&compressor->cond);
+    free(compressor->packed);
+
+    if (compressor->error) {
+        errno = compressor->error;
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/**
+ * @brief Записывает содержимое буфера в дескриптор и, если включен --adaptive, обновляет качество вывода.
+ * Буфер в памяти вместо этого увеличивается вдвое.
+ *
+ * @param out Указатель на буфер вывода.
+ */
+void outFlush(Output *out) {
+    struct timespec begin, end;
+
+    if (out->fd < 0) {
+        size_t capacity = out->capacity ? 2 * out->capacity : OUTPUT_BUFFER_SIZE;
+        char *data = realloc(out->data, capacity);
+
+        if (!data) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+
+        out->data = data;
+        out->capacity = capacity;
+        return;
+    }
+
+    if (out->compressor) {
+        if (out->len) {
+            out->data = compressorSubmit(out->compressor, out->data, out->len);
+            out->len = 0;
+        }
+        return;
+    }
+
+    int queued = out->adaptive ? adaptiveQueued(out->adaptive, out->fd) : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    writeAll(out->fd, out->data, out->len); // Как и раньше с putwchar, ошибки записи не прерывают работу
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    out->len = 0;
+
+    if (out->adaptive) {
+        adaptiveUpdate(out->adaptive, queued, (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+    }
+}
+
+/**
+ * @brief Выводит один байт.
+ *
+ * @param out Указатель на буфер вывода.
+ * @param c Байт.
+ */
+void outPutc(Output *out, char c) {
+    if (out->len == out->capacity) {
+        outFlush(out);
+    }
+
+    out->data[out->len++] = c;
+
+    if (out->lineBuffered && c == '\n') {
+        outFlush(out);
+    }
+}
+
+/**
+ * @brief Сбрасывает буфер вывода в конце работы и, если включен --compress, дописывает сжатый вывод.
+ *
+ * @param out Указатель на буфер вывода.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка сжатого вывода, о которой уже сообщено).
+ */
+int outClose(Output *out) {
+    outFlush(out);
+
+    if (!out->compressor) {
+        return OK;
+    }
+
+    Compressor *compressor = out->compressor;
+
+    // Пустой вывод тоже становится одним кадром, иначе файл нельзя распаковать
+    if (!compressor->submitted) {
+        out->data = compressorSubmit(compressor, out->data, 0);
+    }
+
+    char *spare = compressor->spare;
+    int errCode = compressorFinish(compressor);
+
+    if (errCode != OK) {
+        fwprintf(stderr, L"Cannot write compressed output: %s\n", strerror(errno));
+    }
+
+    free(out->data);
+    free(spare);
+    out->compressor = NULL;
+    out->data = NULL;
+    out->capacity = 0;
+
+    return errCode;
+}
+
+/**
+ * @brief Выводит блок байт.
+ *
+ * @param out Указатель на буфер вывода.
+ * @param data Указатель на блок.
+ * @param size Размер блока в байтах.
+ */
+void outWrite(Output *out, const char *data, size_t size) {
+    // Большой блок пишется напрямую, без копирования в буфер
+    if (out->fd >= 0 && !out->adaptive && !out->compressor && size >= out->capacity) {
+        outFlush(out);
+        writeAll(out->fd, data, size);
+        return;
+    }
+
+    while (out->capacity - out->len < size) {
+        size_t part = out->capacity - out->len;
+
+        // У буфера в памяти до первого сброса еще нет data (memcpy с NULL запрещен даже для 0 байт)
+        if (part) {
+            memcpy(out->data + out->len, data, part);
+            out->len += part;
+            data += part;
+            size -= part;
+        }
+
+        outFlush(out);
+    }
+
+    if (size) {
+        memcpy(out->data + out->len, data, size);
+        out->len += size;
+    }
+}
+
+/**
+ * @brief Выводит управляющую последовательность по формату printf (не длиннее OUTPUT_ESCAPE_MAX).
+ *
+ * @param out Указатель на буфер вывода.
+ * @param format Формат printf.
+ */
+void outPrintf(Output *out, const char *format, ...) {
+    va_list args;
+
+    if (out->capacity - out->len < OUTPUT_ESCAPE_MAX) {
+        outFlush(out);
+    }
+
+    va_start(args, format);
+    int n = vsnprintf(out->data + out->len, OUTPUT_ESCAPE_MAX, format, args);
+    va_end(args);
+
+    if (n > 0) {
+        out->len += n < OUTPUT_ESCAPE_MAX ? n : OUTPUT_ESCAPE_MAX - 1;
+    }
+}
+
+/**
+ * Параметры раскраски, общие для всех входных файлов.
+ *
+ * flags: Указатель на структуру флагов.
+ * hasColor: Флаг, указывающий на наличие цветного вывода.
+ * freq_h, freq_v: Горизонтальная и вертикальная частоты радуги.
+ * offX: Отклонение по горизонтали.
+ * randomOffset: Смещение для генерации случайных цветов.
+ * startColor: Начальный цвет радуги.
+ * gradientTables: Указатель на таблицы градиента --gradient.
+ */
+typedef struct {
+    Flags *flags;
+    int hasColor;
+    double freq_h;
+    double freq_v;
+    double offX;
+    int randomOffset;
+    int startColor;
+    GradientTables *gradientTables;
+} ColorOptions;
+
+/**
+ * Счетчики раскраски, которые переходят из одного входного файла в следующий.
+ *
+ * stringCount: Счетчик строк.
+ * charCountInStr: Счетчик символов в строке.
+ * colorIndex: Номер последнего выведенного цвета (-1 - цвет еще не выводился).
+ * rangeDone: Флаг, указывающий, что последняя строка из --lines уже выведена.
+ */
+typedef struct {
+    int stringCount;
+    int charCountInStr;
+    int colorIndex;
+    int rangeDone;
+} ColorState;
+
+/**
+ * @brief Раскрашивает один входной файл.
+ *
+ * @param filePtr Входной файл.
+ * @param fileName Имя входного файла (нужно для индекса строк --line-index).
+ * @param out Указатель на буфер вывода.
+ * @param options Указатель на параметры раскраски.
+ * @param state Указатель на счетчики, которые обновляются по мере вывода.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка чтения файла).
+ */
+int colorizeFile(FILE *filePtr, const char *fileName, Output *out, ColorOptions *options, ColorState *state) {
+    Flags *flags = options->flags;
+    Adaptive *adaptive = out->adaptive;
+    int hasColor = options->hasColor;
+    double freq_h = options->freq_h;
+    double freq_v = options->freq_v;
+    double offX = options->offX;
+    int randomOffset = options->randomOffset;
+    int startColor = options->startColor;
+    GradientTables *gradientTables = options->gradientTables;
+
+    int stringCount = state->stringCount;
+    int charCountInStr = state->charCountInStr;
+    int colorIndex = state->colorIndex;
+    int rangeDone = state->rangeDone;
+
+    int escapeState = NONE; // Состояние управляющей последовательности
+    double phase = PI * (offX + 2.0f * (randomOffset + startColor) / (double)RAND_MAX); // Начальная фаза --24bit
+    RainbowWindow window = {0, 0, false, {{0}}, {0}}; // Готовые последовательности --24bit для соседних столбцов
+    int ch; // Результат чтения символа
+    char c; // Текущий символ
+
+    // Пропуск строк до начала диапазона --lines
+    if (flags->linesTo && stringCount < flags->linesFrom) {
+        LinePos pos = {0, stringCount, charCountInStr, NONE};
+
+        if (seekToLine(filePtr, fileName, &pos, flags->linesFrom, flags->lineIndex) != OK) {
+            return ERROR;
+        }
+
+        stringCount = pos.lines;
+        charCountInStr = pos.column;
+        escapeState = pos.escapeState;
+    }
+
+    // Построчное чтение файла
+    while (!rangeDone && (ch = getc_unlocked(filePtr)) != EOF) {
+        c = ch;
+
+        // Если включен цветной вывод
+        if (hasColor) {
+            // Обработка управляющих последовательностей
+            escapeState = findEscapeSequences(c, escapeState);
+
+            // Если необходимо вывести символ
+            if (escapeState == ESC_CSI_TERM) {
+                outPutc(out, c);
+            }
+
+            // Если управляющая последовательность завершена
+            if (escapeState == NONE || escapeState == ESC_CSI_TERM) {
+                if (c == '\n') {
+                    stringCount++; // Увеличение счетчика строк
+                    charCountInStr = 0; // Обнуление счетчика символов в строке
+
+                    // Если включен флаг инверсии цвета
+                    if (flags->i) {
+                        outPrintf(out, "\033[49m"); // Установка цвета фона
+                    }
+                } else {
+                    // Если управляющая последовательность завершена
+                    if (escapeState == NONE) {
+                        charCountInStr += wcwidth(c); // Увеличение счетчика символов в строке
+                    }
+
+                    // Качество --adaptive изменилось: цвет выводится заново
+                    if (adaptive && adaptive->changed) {
+                        colorIndex = INT_MIN;
+                        adaptive->changed = false;
+                    }
+
+                    // На лучшем уровне --adaptive вывод такой же, как без него
+                    int lowered = adaptive && adaptive->level != adaptive->bestLevel;
+
+                    // Если включен флаг --24bit
+                    if (flags->b) {
+                        // Вычисление параметра угла
+                        float theta = rainbowTheta(charCountInStr, stringCount, freq_h, freq_v, phase);
+
+                        union rgb_c color;
+
+                        if (lowered) {
+                            // Грубые режимы --adaptive: цвет меняется только вместе с оттенком
+                            int step = adaptiveStep(theta, flags->g);
+
+                            if (colorIndex != step || escapeState == ESC_CSI_TERM) {
+                                colorIndex = step;
+
+                                if (adaptive->level == QUALITY_24BIT_RUNS) {
+                                    color = adaptive->rgb[step];
+                                    outPrintf(out, "\033[%d;2;%d;%d;%dm", (flags->i ? 48 : 38), color.r, color.g,
+                                              color.b);
+                                } else if (adaptive->level == QUALITY_256) {
+                                    outPrintf(out, "\033[%d;5;%hhum", (flags->i ? 48 : 38), adaptive->codes256[step]);
+                                } else {
+                                    outPrintf(out, "\033[%hhum", (flags->i ? 10 : 0) + adaptive->codes16[step]);
+                                }
+                            }
+                        } else if (flags->g) {
+                            // Готовая управляющая последовательность из таблицы градиента
+                            int lookup = lrintf(gradientFactor(theta) * (GRADIENT_TABLE_SIZE - 1));
+
+                            outWrite(out, gradientTables->escapes24[lookup], gradientTables->lengths24[lookup]);
+                        } else {
+                            // Цвета считаются пакетом на окно соседних столбцов строки
+                            if (!window.filled || window.line != stringCount || charCountInStr < window.first ||
+                                charCountInStr >= window.first + RAINBOW_BATCH) {
+                                rainbowWindowFill(&window, charCountInStr, stringCount, freq_h, freq_v, phase, flags->i);
+                            }
+
+                            int slot = charCountInStr - window.first;
+
+                            // Вывод управляющей последовательности для цвета
+                            outWrite(out, window.escapes[slot], window.lengths[slot]);
+                        }
+                    // Если включен флаг --16color
+                    } else if (flags->x) {
+                        int newColorIndex = offX * ARRAY_SIZE(codes16) + (int)(charCountInStr * freq_h + stringCount * freq_v);
+
+                        if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
+                            outPrintf(out, "\033[%hhum", (flags->i ? 10 : 0) +
+                                                       codes16[(randomOffset + startColor + (colorIndex = newColorIndex)) %
+                                                               ARRAY_SIZE(codes16)]);
+                        }
+
+                    } else {
+                        // Если включен флаг --gradient
+                        if (flags->g) {
+                            int newColorIndex = offX * ARRAY_SIZE(codesGradient) + (int)(charCountInStr * freq_h + stringCount * freq_v);
+
+                            if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
+                                size_t lookup = (randomOffset + startColor + (colorIndex = newColorIndex)) %
+                                                (2 * ARRAY_SIZE(codesGradient));
+
+                                if (lookup >= ARRAY_SIZE(codesGradient)) {
+                                    lookup = 2 * ARRAY_SIZE(codesGradient) - 1 - lookup;
+                                }
+
+                                // Вывод управляющей последовательности для цвета
+                                outWrite(out, gradientTables->escapes256[lookup], gradientTables->lengths256[lookup]);
+                            }
+                        } else {
+                            // Если не включен флаг --gradient
+                            int newColorIndex = offX * ARRAY_SIZE(codes) + (int)(stringCount * freq_h + stringCount * freq_v);
+                            if (colorIndex != newColorIndex || escapeState == ESC_CSI_TERM) {
+                                size_t lookup = (randomOffset + startColor + (colorIndex = newColorIndex)) % ARRAY_SIZE(codes);
+
+                                // Вывод управляющей последовательности для цвета
+                                if (lowered) {
+                                    // --adaptive понизил качество до 16 цветов
+                                    outPrintf(out, "\033[%hhum", (flags->i ? 10 : 0) + adaptive->codes16ForCodes[lookup]);
+                                } else {
+                                    outPrintf(out, "\033[%d;5;%hhum", (flags->i ? 48 : 38), codes[lookup]);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        } else if (flags->linesTo) {
+            // Без цвета строки считаются только для --lines
+            escapeState = findEscapeSequences(c, escapeState);
+
+            if ((escapeState == NONE || escapeState == ESC_CSI_TERM) && c == '\n') {
+                stringCount++;
+            }
+        }
+
+        // Последняя строка диапазона --lines выведена
+        if (flags->linesTo && c == '\n' && stringCount >= flags->linesTo) {
+            rangeDone = true;
+        }
+
+        // Если управляющая последовательность завершена
+        if (!hasColor || escapeState != ESC_CSI_TERM) {
+            outPutc(out, c); // Вывод символа
+        }
+    }
+
+    // Восстановление стандартного цвета после окончания обработки файла
+    if (hasColor) {
+        outPrintf(out, "\033[0m"); // Сброс цвета
+    }
+
+    state->stringCount = stringCount;
+    state->charCountInStr = charCountInStr;
+    state->colorIndex = colorIndex;
+    state->rangeDone = rangeDone;
+
+    return ferror(filePtr) ? ERROR : OK;
+}
+
+#define STRIP_BLOCK_SIZE 262144 // Размер блока чтения для --strip и --normalize
+
+/**
+ * Состояние опций --strip и --normalize внутри одного входного файла.
+ *
+ * mode: Режим (enum stripMode).
+ * escapeState: Состояние автомата findEscapeSequences.
+ * keeping: Флаг, указывающий, что текущая последовательность точно не SGR и выводится как есть (--normalize).
+ * pending: Начало текущей последовательности, про которую еще неизвестно, SGR ли она (--normalize).
+ * pendingLen, pendingCapacity: Длина и размер pending.
+ */
+typedef struct {
+    int mode;
+    int escapeState;
+    int keeping;
+    char *pending;
+    size_t pendingLen;
+    size_t pendingCapacity;
+} Stripper;
+
+/**
+ * @brief Обрабатывает один байт управляющей последовательности в режиме --normalize.
+ *
+ * SGR - это последовательность CSI (ESC [) с последним байтом 'm'. Пока это не ясно, байты копятся в pending;
+ * другие последовательности выводятся без изменений.
+ *
+ * @param stripper Указатель на состояние.
+ * @param out Указатель на буфер вывода.
+ * @param c Байт.
+ * @param previous Состояние автомата до этого байта.
+ */
+void normalizeByte(Stripper *stripper, Output *out, char c, int previous) {
+    if (previous == NONE || previous == ESC_CSI_TERM) {
+        stripper->pendingLen = 0;
+        stripper->keeping = false;
+    } else if (stripper->keeping) {
+        outWrite(out, &c, 1);
+        return;
+    }
+
+    if (stripper->pendingLen == stripper->pendingCapacity) {
+        stripper->pendingCapacity = stripper->pendingCapacity ? 2 * stripper->pendingCapacity : 64;
+        stripper->pending = realloc(stripper->pending, stripper->pendingCapacity);
+
+        if (!stripper->pending) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+    }
+
+    stripper->pending[stripper->pendingLen++] = c;
+
+    if (stripper->pendingLen == 2 && c != '[') {
+        // Не CSI: выводим как есть до конца последовательности
+        stripper->keeping = true;
+        outWrite(out, stripper->pending, stripper->pendingLen);
+        stripper->pendingLen = 0;
+    } else if (stripper->escapeState == ESC_CSI_TERM) {
+        if (c != 'm') {
+            outWrite(out, stripper->pending, stripper->pendingLen);
+        }
+
+        stripper->pendingLen = 0;
+    }
+}
+
+/**
+ * @brief Удаляет управляющие последовательности из блока входа.
+ *
+ * Текст между последовательностями находится через memchr (в glibc он векторизован) и копируется целиком,
+ * через автомат findEscapeSequences побайтно проходят только сами последовательности.
+ *
+ * @param stripper Указатель на состояние.
+ * @param out Указатель на буфер вывода.
+ * @param data Указатель на блок.
+ * @param size Размер блока в байтах.
+ */
+void stripBlock(Stripper *stripper, Output *out, const char *data, size_t size) {
+    const char *end = data + size;
+
+    while (data < end) {
+        if (stripper->escapeState == NONE || stripper->escapeState == ESC_CSI_TERM) {
+            const char *escape = memchr(data, '\033', end - data);
+            const char *textEnd = escape ? escape : end;
+
+            if (textEnd > data) {
+                outWrite(out, data, textEnd - data);
+                stripper->escapeState = NONE;
+                data = textEnd;
+                continue;
+            }
+        }
+
+        int previous = stripper->escapeState;
+
+        stripper->escapeState = findEscapeSequences(*data, previous);
+
+        if (stripper->mode == STRIP_SGR) {
+            normalizeByte(stripper, out, *data, previous);
+        }
+
+        data++;
+    }
+}
+
+/**
+ * @brief Удаляет управляющие последовательности из входного файла (опции --strip и --normalize).
+ *
+ * @param fd Дескриптор входного файла.
+ * @param out Указатель на буфер вывода.
+ * @param mode Режим (enum stripMode).
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка чтения).
+ */
+int stripFile(int fd, Output *out, int mode) {
+    static char block[STRIP_BLOCK_SIZE];
+    Stripper stripper = {mode, NONE, false, NULL, 0, 0};
+    int errCode = OK;
+
+    for (;;) {
+        ssize_t size = read(fd, block, sizeof(block));
+
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (size <= 0) {
+            errCode = size < 0 ? ERROR : OK;
+            break;
+        }
+
+        stripBlock(&stripper, out, block, size);
+
+        // Вход иссяк: отдаем то, что есть, не дожидаясь заполнения буфера (как в tail -f | lolcat --strip).
+        // Со сжатием каждый сброс стал бы отдельным кадром, поэтому буфер копится до заполнения
+        if (size < (ssize_t)sizeof(block) && !out->compressor) {
+            outFlush(out);
+        }
+    }
+
+    // Оборванная в конце файла последовательность в режиме --normalize остается как есть
+    if (stripper.pendingLen) {
+        outWrite(out, stripper.pending, stripper.pendingLen);
+    }
+
+    free(stripper.pending);
+
+    return errCode;
+}
+
+#define PARALLEL_WINDOW 1024 // На сколько файлов вперед от последнего выведенного могут уйти потоки
+
+// TASK_PENDING: Файл еще не обработан.
+// TASK_DONE: Файл обработан успешно.
+// TASK_OPEN_FAILED, TASK_READ_FAILED, TASK_CLOSE_FAILED: Файл не удалось открыть, прочитать или закрыть.
+enum taskStatus { TASK_PENDING = 0, TASK_DONE, TASK_OPEN_FAILED, TASK_READ_FAILED, TASK_CLOSE_FAILED };
+
+/**
+ * Очередь задач одного потока. Владелец и воры берут задачи с начала очереди: вывод идет в порядке файлов,
+ * поэтому самый срочный - файл с наименьшим номером.
+ *
+ * lock: Мьютекс очереди.
+ * tasks: Номера файлов по возрастанию.
+ * head, tail: Границы невыполненной части tasks.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t head;
+    size_t tail;
+} WorkQueue;
+
+/**
+ * Общее состояние опции --jobs.
+ *
+ * fileNames, count: Входные файлы.
+ * options: Указатель на параметры раскраски.
+ * scanning: Флаг, указывающий, что идет предварительный подсчет строк, а не раскраска.
+ * starts: Для подсчета - количество строк и ширина хвоста каждого файла, для раскраски - счетчики в начале файла.
+ * outputs: Результат раскраски каждого файла.
+ * status, errors: Состояние обработки каждого файла (enum taskStatus) и errno при ошибке.
+ * queues, threadCount: Очереди задач потоков и их количество.
+ * lock, progress: Мьютекс и условная переменная для status, emitted и abort.
+ * emitted: Количество уже выведенных файлов.
+ * abort: Флаг, указывающий, что потокам нужно завершиться, не дожидаясь конца работы.
+ */
+typedef struct {
+    char **fileNames;
+    size_t count;
+    ColorOptions *options;
+    int scanning;
+    LinePos *starts;
+    Output *outputs;
+    int *status;
+    int *errors;
+    WorkQueue *queues;
+    int threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    size_t emitted;
+    int abort;
+} ParallelJob;
+
+/**
+ * Аргумент потока: общее состояние и номер собственной очереди.
+ */
+typedef struct {
+    ParallelJob *job;
+    int id;
+} ParallelWorker;
+
+/**
+ * @brief Берет задачу с начала очереди, если ее номер меньше limit.
+ *
+ * @param queue Указатель на очередь.
+ * @param limit Граница номеров задач.
+ * @param task Указатель на переменную для номера задачи.
+ * @param empty Указатель на флаг, который сбрасывается, если в очереди есть задачи.
+ * @return true, если задача взята.
+ */
+int queueTake(WorkQueue *queue, size_t limit, size_t *task, int *empty) {
+    int taken = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->head < queue->tail) {
+        *empty = false;
+
+        if (queue->tasks[queue->head] < limit) {
+            *task = queue->tasks[queue->head++];
+            taken = true;
+        }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+/**
+ * @brief Выбирает следующую задачу потока: сначала из своей очереди, затем крадет из чужих.
+ * При раскраске не берет файлы дальше PARALLEL_WINDOW от последнего выведенного, а ждет вывода.
+ *
+ * @param job Указатель на общее состояние.
+ * @param id Номер очереди потока.
+ * @param task Указатель на переменную для номера задачи.
+ * @return true, если задача взята, false, если задачи кончились.
+ */
+int parallelTake(ParallelJob *job, int id, size_t *task) {
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t emitted = job->emitted;
+        int abort = job->abort;
+        pthread_mutex_unlock(&job->lock);
+
+        if (abort) {
+            return false;
+        }
+
+        size_t limit = job->scanning ? SIZE_MAX : emitted + PARALLEL_WINDOW;
+        int empty = true;
+
+        for (int i = 0; i < job->threadCount; ++i) {
+            if (queueTake(&job->queues[(id + i) % job->threadCount], limit, task, &empty)) {
+                return true;
+            }
+        }
+
+        if (empty) {
+            return false;
+        }
+
+        // Все оставшиеся файлы слишком далеко впереди: ждем, пока основной поток выведет очередной
+        pthread_mutex_lock(&job->lock);
+
+        while (job->emitted == emitted && !job->abort) {
+            pthread_cond_wait(&job->progress, &job->lock);
+        }
+
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/**
+ * @brief Обрабатывает один файл: считает в нем строки или раскрашивает его в буфер в памяти.
+ *
+ * @param job Указатель на общее состояние.
+ * @param task Номер файла.
+ * @return Состояние обработки (enum taskStatus).
+ */
+int parallelRun(ParallelJob *job, size_t task) {
+    FILE *filePtr = fopen(job->fileNames[task], "r");
+    int status = TASK_DONE;
+
+    if (!filePtr) {
+        return TASK_OPEN_FAILED;
+    }
+
+    if (job->scanning) {
+        if (countLines(filePtr, &job->starts[task]) != OK) {
+            status = TASK_READ_FAILED;
+        }
+    } else {
+        LinePos *start = &job->starts[task];
+        ColorState state = {start->lines, start->column, -1, false};
+        Output *out = &job->outputs[task];
+
+        out->fd = -1;
+
+        if (colorizeFile(filePtr, job->fileNames[task], out, job->options, &state) != OK) {
+            status = TASK_READ_FAILED;
+        }
+    }
+
+    if (fclose(filePtr) && status == TASK_DONE) {
+        status = TASK_CLOSE_FAILED;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Функция потока --jobs: обрабатывает задачи, пока они есть.
+ *
+ * @param arg Указатель на ParallelWorker.
+ * @return NULL.
+ */
+void *parallelWorker(void *arg) {
+    ParallelWorker *worker = arg;
+    ParallelJob *job = worker->job;
+    size_t task;
+
+    while (parallelTake(job, worker->id, &task)) {
+        int status = parallelRun(job, task);
+        int error = errno;
+
+        pthread_mutex_lock(&job->lock);
+        job->status[task] = status;
+        job->errors[task] = error;
+        pthread_cond_broadcast(&job->progress);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Раздает файлы по очередям потоков (через один, чтобы потоки шли по файлам примерно по порядку)
+ * и запускает потоки.
+ *
+ * @param job Указатель на общее состояние.
+ * @param threads Массив для идентификаторов потоков.
+ * @param workers Массив для аргументов потоков.
+ * @return Количество запущенных потоков.
+ */
+int parallelStart(ParallelJob *job, pthread_t *threads, ParallelWorker *workers) {
+    int started = 0;
+    int error = 0;
+
+    for (int i = 0; i < job->threadCount; ++i) {
+        WorkQueue *queue = &job->queues[i];
+
+        queue->head = queue->tail = 0;
+
+        for (size_t task = i; task < job->count; task += job->threadCount) {
+            queue->tasks[queue->tail++] = task;
+        }
+    }
+
+    memset(job->status, 0, job->count * sizeof(*job->status));
+    job->emitted = 0;
+    job->abort = false;
+
+    for (int i = 0; i < job->threadCount; ++i) {
+        workers[i].job = job;
+        workers[i].id = i;
+
+        if (!(error = pthread_create(&threads[i], NULL, parallelWorker, &workers[i]))) {
+            started++;
+        }
+    }
+
+    // Очереди не запущенных потоков разберут остальные
+    if (started == 0) {
+        fwprintf(stderr, L"Cannot create threads: %s\n", strerror(error));
+        exit(ERROR);
+    }
+
+    return started;
+}
+
+/**
+ * @brief Дожидается завершения потоков.
+ *
+ * @param threads Массив идентификаторов потоков.
+ * @param count Количество потоков.
+ */
+void parallelJoin(pthread_t *threads, int count) {
+    for (int i = 0; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * @brief Раскрашивает файлы на нескольких потоках (опция --jobs) и выводит результат в порядке файлов.
+ *
+ * Если радуга продолжается из файла в файл, сначала все файлы параллельно прогоняются через countLines,
+ * и из количества строк и ширины хвостов вычисляются счетчики в начале каждого файла, поэтому цвета
+ * совпадают с последовательным запуском.
+ *
+ * @param fileNames Входные файлы.
+ * @param count Количество входных файлов.
+ * @param out Указатель на буфер стандартного вывода.
+ * @param options Указатель на параметры раскраски.
+ * @param threadCount Количество потоков.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка в процессе выполнения).
+ */
+int colorizeParallel(char **fileNames, size_t count, Output *out, ColorOptions *options, int threadCount) {
+    ParallelJob job = {fileNames, count, options, false, NULL, NULL, NULL, NULL, NULL, threadCount,
+                       PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false};
+    pthread_t *threads = malloc(threadCount * sizeof(*threads));
+    ParallelWorker *workers = malloc(threadCount * sizeof(*workers));
+    int errCode = OK;
+
+    job.starts = calloc(count, sizeof(*job.starts));
+    job.outputs = calloc(count, sizeof(*job.outputs));
+    job.status = calloc(count, sizeof(*job.status));
+    job.errors = calloc(count, sizeof(*job.errors));
+    job.queues = calloc(threadCount, sizeof(*job.queues));
+
+    if (!threads || !workers || !job.starts || !job.outputs || !job.status || !job.errors || !job.queues) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(ERROR);
+    }
+
+    for (int i = 0; i < threadCount; ++i) {
+        pthread_mutex_init(&job.queues[i].lock, NULL);
+        job.queues[i].tasks = malloc((count / threadCount + 1) * sizeof(*job.queues[i].tasks));
+
+        if (!job.queues[i].tasks) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+    }
+
+    // Предварительный подсчет строк: ошибки чтения здесь не важны, о них сообщит раскраска
+    if (options->hasColor && !options->flags->filePhaseReset) {
+        job.scanning = true;
+        parallelJoin(threads, parallelStart(&job, threads, workers));
+        job.scanning = false;
+
+        LinePos carry = {0, 0, 0, NONE};
+
+        for (size_t i = 0; i < count; ++i) {
+            LinePos fileLines = job.starts[i];
+
+            job.starts[i] = carry;
+            carry.lines += fileLines.lines;
+            carry.column = fileLines.lines ? fileLines.column : carry.column + fileLines.column;
+        }
+    }
+
+    outFlush(out);
+
+    int started = parallelStart(&job, threads, workers);
+
+    for (size_t i = 0; i < count; ++i) {
+        pthread_mutex_lock(&job.lock);
+
+        while (job.status[i] == TASK_PENDING) {
+            pthread_cond_wait(&job.progress, &job.lock);
+        }
+
+        pthread_mutex_unlock(&job.lock);
+
+        // Все, что было до файла с ошибкой, уже выведено, как и при последовательной обработке
+        if (job.status[i] != TASK_DONE) {
+            outWrite(out, job.outputs[i].data, job.outputs[i].len);
+            outFlush(out);
+
+            if (job.status[i] == TASK_OPEN_FAILED) {
+                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", fileNames[i], strerror(job.errors[i]));
+            } else if (job.status[i] == TASK_READ_FAILED) {
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", fileNames[i], strerror(job.errors[i]));
+            } else {
+                fwprintf(stderr, L"Error closing input file \"%s\": %s\n", fileNames[i], strerror(job.errors[i]));
+            }
+
+            errCode = ERROR;
+            break;
+        }
+
+        // Со сжатием файлы копятся в большом буфере, иначе каждый выводится сразу
+        outWrite(out, job.outputs[i].data, job.outputs[i].len);
+
+        if (!out->compressor) {
+            outFlush(out);
+        }
+
+        free(job.outputs[i].data);
+        job.outputs[i].data = NULL;
+
+        pthread_mutex_lock(&job.lock);
+        job.emitted = i + 1;
+        pthread_cond_broadcast(&job.progress);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.abort = true;
+    pthread_cond_broadcast(&job.progress);
+    pthread_mutex_unlock(&job.lock);
+
+    parallelJoin(threads, started);
+
+    for (size_t i = 0; i < count; ++i) {
+        free(job.outputs[i].data);
+    }
+
+    for (int i = 0; i < threadCount; ++i) {
+        pthread_mutex_destroy(&job.queues[i].lock);
+        free(job.queues[i].tasks);
+    }
+
+    free(job.starts);
+    free(job.outputs);
+    free(job.status);
+    free(job.errors);
+    free(job.queues);
+    free(threads);
+    free(workers);
+
+    return errCode;
+}
+
+#define CACHE_VERSION 1 // Меняется, когда меняется вывод при тех же входе и опциях
+#define CACHE_NAME_LENGTH 32 // Длина имени файла в кеше: два 64-битных хеша в hex
+#define CACHE_TMP_PREFIX ".tmp-" // Начало имени временного файла, который заполняет промах
+#define CACHE_TMP_STALE 3600 // Через сколько секунд без изменений временный файл считается брошенным
+
+/**
+ * Вход, целиком прочитанный в память для --cache.
+ *
+ * data: Содержимое.
+ * size: Размер в байтах.
+ */
+typedef struct {
+    char *data;
+    size_t size;
+} CacheInput;
+
+/**
+ * @brief Читает дескриптор до конца в память.
+ *
+ * @param fd Дескриптор.
+ * @param input Указатель на вход, в который записывается содержимое.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - ошибка чтения).
+ */
+int readAll(int fd, CacheInput *input) {
+    size_t capacity = 0;
+
+    input->data = NULL;
+    input->size = 0;
+
+    for (;;) {
+        if (input->size == capacity) {
+            capacity = capacity ? 2 * capacity : 65536;
+            char *data = realloc(input->data, capacity);
+
+            if (!data) {
+                free(input->data);
+                input->data = NULL;
+                errno = ENOMEM;
+                return ERROR;
+            }
+
+            input->data = data;
+        }
+
+        ssize_t n = read(fd, input->data + input->size, capacity - input->size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0) {
+            free(input->data);
+            input->data = NULL;
+            return ERROR;
+        }
+
+        if (n == 0) {
+            return OK;
+        }
+
+        input->size += n;
+    }
+}
+
+/**
+ * @brief Читает все входные файлы в память, чтобы посчитать их хеш и раскрасить ровно то, что было захешировано.
+ * Останавливается на первом файле, который не удалось прочитать: он и следующие обрабатываются как обычно.
+ *
+ * @param fileNames Входные файлы.
+ * @param count Количество входных файлов.
+ * @param inputs Массив для содержимого файлов.
+ * @return Количество прочитанных файлов.
+ */
+size_t cachePreload(char **fileNames, size_t count, CacheInput *inputs) {
+    int stdinRead = false;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!strcmp(fileNames[i], "-")) {
+            // Стандартный ввод читается один раз, дальше он пуст, как и при обычной обработке
+            if (stdinRead) {
+                inputs[i].data = NULL;
+                inputs[i].size = 0;
+            } else if (readAll(STDIN_FILENO, &inputs[i]) != OK) {
+                return i;
+            }
+
+            stdinRead = true;
+            continue;
+        }
+
+        int fd = open(fileNames[i], O_RDONLY);
+
+        if (fd < 0) {
+            return i;
+        }
+
+        int errCode = readAll(fd, &inputs[i]);
+
+        close(fd);
+
+        if (errCode != OK) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Считает имя файла в кеше: хеш содержимого входов и хеш всех параметров, влияющих на вывод.
+ *
+ * @param inputs Содержимое входов.
+ * @param count Количество входов.
+ * @param options Указатель на параметры раскраски (вместе с уже вычисленными offX и randomOffset).
+ * @param gradient Указатель на градиент.
+ * @param name Массив для имени длиной CACHE_NAME_LENGTH + 1.
+ */
+void cacheName(CacheInput *inputs, size_t count, ColorOptions *options, Gradient *gradient, char *name) {
+    uint64_t contentHash = 14695981039346656037ULL;
+    uint64_t optionsHash = 14695981039346656037ULL;
+    Flags *flags = options->flags;
+    const char *locale = setlocale(LC_CTYPE, NULL);
+    int version = CACHE_VERSION;
+
+    // Размер каждого входа тоже хешируется, чтобы различать границы файлов
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t size = inputs[i].size;
+
+        contentHash = fnv1a(contentHash, &size, sizeof(size));
+        contentHash = fnv1a(contentHash, inputs[i].data, inputs[i].size);
+    }
+
+    int flagValues[] = {version, flags->i, flags->b, flags->x, flags->g, flags->linesFrom, flags->linesTo,
+                        options->randomOffset, options->startColor, gradient->count, gradient->oklab};
+    double doubleValues[] = {options->freq_h, options->freq_v, options->offX};
+
+    optionsHash = fnv1a(optionsHash, flagValues, sizeof(flagValues));
+    optionsHash = fnv1a(optionsHash, doubleValues, sizeof(doubleValues));
+
+    for (int i = 0; flags->g && i < gradient->count; ++i) {
+        unsigned char stop[] = {gradient->stops[i].r, gradient->stops[i].g, gradient->stops[i].b};
+        optionsHash = fnv1a(optionsHash, stop, sizeof(stop));
+    }
+
+    // От локали зависит ширина символов
+    optionsHash = fnv1a(optionsHash, locale, locale ? strlen(locale) : 0);
+
+    snprintf(name, CACHE_NAME_LENGTH + 1, "%016llx%016llx", (unsigned long long)contentHash,
+             (unsigned long long)optionsHash);
+}
+
+/**
+ * @brief Определяет папку кеша и создает ее вместе с недостающими родительскими папками.
+ *
+ * @param option Значение --cache=DIR или NULL.
+ * @param path Массив для пути.
+ * @param size Размер массива.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - папку не удалось создать).
+ */
+int cacheDirectory(const char *option, char *path, size_t size) {
+    const char *xdgCache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int length;
+
+    if (option) {
+        length = snprintf(path, size, "%s", option);
+    } else if (xdgCache && *xdgCache) {
+        length = snprintf(path, size, "%s/lolcat", xdgCache);
+    } else if (home && *home) {
+        length = snprintf(path, size, "%s/.cache/lolcat", home);
+    } else {
+        errno = ENOENT;
+        return ERROR;
+    }
+
+    if (length <= 0 || (size_t)length >= size) {
+        errno = ENAMETOOLONG;
+        return ERROR;
+    }
+
+    for (char *slash = path + 1; ; ++slash) {
+        if (*slash == '/' || *slash == '\0') {
+            char saved = *slash;
+
+            *slash = '\0';
+
+            if (mkdir(path, 0700) && errno != EEXIST) {
+                return ERROR;
+            }
+
+            *slash = saved;
+
+            if (saved == '\0') {
+                return OK;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Выводит файл из кеша в дескриптор через sendfile в Linux (или через mmap, если sendfile не поддерживается)
+ * и отмечает его как недавно использованный.
+ *
+ * @param path Путь к файлу в кеше.
+ * @param outFd Дескриптор вывода.
+ * @return Код ошибки (OK - успешное выполнение, ERROR - файла нет или его не удалось вывести).
+ */
+int cacheServe(const char *path, int outFd) {
+    int fd = open(path, O_RDONLY);
+    struct stat fileStat;
+
+    if (fd < 0) {
+        return ERROR;
+    }
+
+    if (fstat(fd, &fileStat)) {
+        close(fd);
+        return ERROR;
+    }
+
+    // Время изменения файла служит временем последнего использования для вытеснения
+    futimens(fd, NULL);
+
+    off_t offset = 0;
+    int errCode = OK;
+
+#ifdef __linux__
+    while (offset < fileStat.st_size) {
+        ssize_t n = sendfile(outFd, fd, &offset, fileStat.st_size - offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            errCode = ERROR;
+            break;
+        }
+    }
+#else
+    if (fileStat.st_size) {
+        errCode = ERROR;
+        errno = ENOSYS;
+    }
+#endif
+
+    // sendfile не умеет писать в этот дескриптор: выводим из отображенного файла
+    if (errCode != OK && offset == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        void *data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED) {
+            errCode = writeAll(outFd, data, fileStat.st_size);
+            munmap(data, fileStat.st_size);
+        }
+    }
+
+    close(fd);
+
+    return errCode;
+}
+
+/**
+ * Файл кеша при вытеснении.
+ */
+typedef struct {
+    char name[CACHE_NAME_LENGTH + 1];
+    struct timespec used;
+    long long size;
+} CacheEntry;
+
+/**
+ * @brief Сравнивает файлы кеша по времени последнего использования для qsort.
+ *
+ * @param a Указатель на первый CacheEntry.
+ * @param b Указатель на второй CacheEntry.
+ * @return Отрицательное число, ноль или положительное число, как требует qsort.
+ */
+int cacheEntryCompare(const void *a, const void *b) {
+    const CacheEntry *left = a, *right = b;
+
+    if (left->used.tv_sec != right->used.tv_sec) {
+        return (left->used.tv_sec > right->used.tv_sec) - (left->used.tv_sec < right->used.tv_sec);
+    }
+
+    return (left->used.tv_nsec > right->used.tv_nsec) - (left->used.tv_nsec < right->used.tv_nsec);
+}
+
+/**
+ * @brief Удаляет давно не использованные файлы кеша, пока его размер больше limit.
+ *
+ * @param dir Папка кеша.
+ * @param limit Предельный размер кеша в байтах.
+ */
+void cacheEvict(const char *dir, long long limit) {
+    DIR *dirPtr = opendir(dir);
+    CacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *dirEntry;
+
+    if (!dirPtr) {
+        return;
+    }
+
+    while ((dirEntry = readdir(dirPtr))) {
+        struct stat fileStat;
+
+        // Временный файл прерванного запуска никогда не станет файлом кеша
+        if (!strncmp(dirEntry->d_name, CACHE_TMP_PREFIX, strlen(CACHE_TMP_PREFIX))) {
+            if (!fstatat(dirfd(dirPtr), dirEntry->d_name, &fileStat, 0) && S_ISREG(fileStat.st_mode) &&
+                time(NULL) - fileStat.st_mtime > CACHE_TMP_STALE) {
+                unlinkat(dirfd(dirPtr), dirEntry->d_name, 0);
+            }
+            continue;
+        }
+
+        if (strlen(dirEntry->d_name) != CACHE_NAME_LENGTH ||
+            strspn(dirEntry->d_name, "0123456789abcdef") != CACHE_NAME_LENGTH ||
+            fstatat(dirfd(dirPtr), dirEntry->d_name, &fileStat, 0) || !S_ISREG(fileStat.st_mode)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            CacheEntry *grown = realloc(entries, capacity * sizeof(*entries));
+
+            if (!grown) {
+                break;
+            }
+
+            entries = grown;
+        }
+
+        memcpy(entries[count].name, dirEntry->d_name, CACHE_NAME_LENGTH + 1);
+#ifdef __APPLE__
+        entries[count].used = fileStat.st_mtimespec;
+#else
+        entries[count].used = fileStat.st_mtim;
+#endif
+        entries[count].size = fileStat.st_size;
+        total += fileStat.st_size;
+        count++;
+    }
+
+    if (total > limit) {
+        qsort(entries, count, sizeof(*entries), cacheEntryCompare);
+
+        for (size_t i = 0; i < count && total > limit; ++i) {
+            if (!unlinkat(dirfd(dirPtr), entries[i].name, 0) || errno == ENOENT) {
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+    closedir(dirPtr);
+}
+
+int main(int argc, char **argv) {
+    char *defaultArgv[] = {"-"}; // Массив для хранения аргументов командной строки по умолчанию
+    double freq_h = 0.23; // Горизонтальная частота радуги по умолчанию
+    double freq_v = 0.01; // Вертикальная частота радуги по умолчанию
+    int startColor = 0; // Начальный цвет радуги
+    Gradient gradient = {{{{0}}}, 0, false}; // Цвета градиента
+    static GradientTables gradientTables; // Таблицы градиента для каждого режима вывода
+
+    int hasColor = isatty(STDOUT_FILENO); // Флаг, указывающий на наличие цветного вывода
+
+    struct timeval timeVal; // Структура для хранения времени
+    gettimeofday(&timeVal, NULL); // Получение текущего времени
+    double offX = (timeVal.tv_sec % 300) / 300.0; // Отклонение по горизонтали
+
+
+    int seed = time(NULL); // сид для генерации случайных чисел
+    int errCode = OK;
+    Flags flags = {false, true, false, false, false, false, false, false, 0, 0, false, false, 0, false, false, NULL, 64, -1, STRIP_OFF, COMPRESS_OFF}; // Иницилизация структуры флагов
+    char *flagsString = ":h:v:s:g:flrobxi?"; // Строка с опциями командной строки
+    int flagSymbol;
+
+    struct option longFlags[] = {{"horizontal-frequency", 0, NULL, 'h'}, // Длинные опции командной строки
+                                 {"vertical-frequency", 0, NULL, 'v'},
+                                 {"force-color", 0, NULL, 'f'},
+                                 {"no-force-locale", 0, NULL, 'l'},
+                                 {"random", 0, NULL, 'r'},
+                                 {"seed", 0, NULL, 's'},
+                                 {"color_offset", 0, NULL, 'o'},
+                                 {"24bit", 0, NULL, 'b'},
+                                 {"16color", 0, NULL, 'x'},
+                                 {"invert", 0, NULL, 'i'},
+                                 {"gradient", 0, NULL, 'g'},
+                                 {"help", 0, NULL, '1'},
+                                 {"lines", 1, NULL, '2'},
+                                 {"line-index", 0, NULL, '3'},
+                                 {"adaptive", 0, NULL, '4'},
+                                 {"jobs", 1, NULL, '5'},
+                                 {"file-phase", 1, NULL, '6'},
+                                 {"interpolate", 1, NULL, '7'},
+                                 {"cache", 2, NULL, '8'},
+                                 {"cache-size", 1, NULL, '9'},
+                                 {"phase", 1, NULL, '0'},
+                                 {"strip", 0, NULL, 'S'}, // Только длинная опция
+                                 {"normalize", 0, NULL, 'N'}, // Только длинная опция
+                                 {"compress", 1, NULL, 'Z'}, // Только длинная опция
+                                 {NULL, 0, NULL, 0}};
+
+    // Обработка опций командной строки
+    while (((flagSymbol = getopt_long(argc, argv, flagsString, longFlags, NULL)) != -1)) {
+        errCode = initStruct(&flags, flagSymbol, &seed, &freq_h, &freq_v, &startColor, &gradient);
+    }
+
+    if (errCode != ERROR) {
+        // Проверка на одновременное указание опций --24bit и --16color
+        if (flags.b && flags.x) {
+            wprintf(L"Only one of --24bit and --16color can be given at a time\n");
+            exit(ERROR);
+        }
+    }
+
+    // обработка флага --help
+    if (flags.help) {
+        printf("%s", helpStr); // Вывод справки
+        return 0;
+    }
+
+    // Проверка флагов, несовместимых с --jobs
+    if (flags.jobs && (flags.linesTo || flags.adaptive)) {
+        wprintf(L"--jobs can't be combined with --lines or --adaptive\n");
+        exit(ERROR);
+    }
+
+    // Проверка флагов, несовместимых с --strip и --normalize
+    if (flags.strip && (flags.jobs || flags.adaptive || flags.cache || flags.linesTo)) {
+        wprintf(L"--strip and --normalize can't be combined with --jobs, --adaptive, --cache or --lines\n");
+        exit(ERROR);
+    }
+
+    // Проверка флагов, несовместимых с --compress
+    if (flags.compress && (flags.cache || flags.adaptive)) {
+        wprintf(L"--compress can't be combined with --cache or --adaptive\n");
+        exit(ERROR);
+    }
+
+    // Проверка флагов, несовместимых с --cache (вывод --adaptive зависит от скорости потребителя)
+    if (flags.cache && (flags.jobs || flags.adaptive)) {
+        wprintf(L"--cache can't be combined with --jobs or --adaptive\n");
+        exit(ERROR);
+    }
+
+    // Обработка флага --force-color (нужен, чтобы --adaptive работал и на каналах)
+    if (flags.f) {
+        hasColor = true;
+    }
+
+    // Проверка флага --gradient
+    if (flags.g) {
+        // Проверка конфликтующего флага --16color
+        if (flags.x) {
+            wprintf(L"--gradient and --16color are mutually exclusive\n");
+            exit(2);
+        }
+
+        // Если не указан флаг --24bit
+        if (!flags.b) {
+            size_t codesGradientSize = ARRAY_SIZE(codesGradient); // Размер массива цветов радуги
+            double correctionFactor = 2 * codesGradientSize / (double)ARRAY_SIZE(codes); // Корректировочный коэффициент для частот
+            freq_h *= correctionFactor; // Коррекция горизонтальной частоты
+            freq_v *= correctionFactor; // Коррекция вертикальной частоты
+        }
+
+        // Раскладка градиента в таблицы готовых управляющих последовательностей
+        gradientCompile(&gradient, &gradientTables, flags.i);
+    }
+
+    int randomOffset = 0; // Смещение для генерации случайных чисел
+
+    // Генерация случайного смещения, если указан флаг --random
+    if (flags.r) {
+        srand(seed);
+        randomOffset = rand();
+    }
+
+    char **inputsBegin = argv + optind; // Указатель на начало аргументов командной строки
+    char **inputsEnd = argv + argc; // Указатель на конец аргументов командной строки
+
+    // Если нет переданных файлов в аргументах командной строки, используем стандартный ввод
+    if (inputsBegin == inputsEnd) {
+        inputsBegin = defaultArgv;
+        inputsEnd = inputsBegin + 1;
+    }
+
+    char *envLang = getenv("LANG");  // return en_GB.UTF-8
+
+    // Установка локали
+    if (flags.l && envLang && !strstr(envLang, "UTF-8")) {
+        if (!setlocale(LC_ALL, "C.UTF-8")) {
+            setlocale(LC_ALL, ""); // Использование текущей локали
+        }
+    } else {
+        setlocale(LC_ALL, ""); // Использование текущей локали
+    }
+
+    // Обработка флага --phase
+    if (flags.phase >= 0) {
+        offX = flags.phase;
+    }
+
+    ColorOptions options = {&flags, hasColor, freq_h, freq_v, offX, randomOffset, startColor, &gradientTables};
+    ColorState state = {0, 0, -1, false}; // Счетчики строк и символов, номер цвета
+    size_t inputCount = inputsEnd - inputsBegin; // Количество входных файлов
+    CacheInput *cacheInputs = NULL; // Содержимое входных файлов для --cache
+    size_t cachedCount = 0; // Количество входных файлов, прочитанных в память
+    char cacheDir[PATH_MAX]; // Папка кеша
+    char cachePath[PATH_MAX + CACHE_NAME_LENGTH + 2] = ""; // Путь к файлу кеша, который сейчас заполняется
+    char cacheTmpPath[PATH_MAX + CACHE_NAME_LENGTH + 2]; // Путь к временному файлу кеша
+
+    static char outData[OUTPUT_BUFFER_SIZE];
+    Output out = {STDOUT_FILENO, isatty(STDOUT_FILENO), NULL, NULL, 0, sizeof(outData), outData}; // Буфер стандартного вывода
+    Adaptive adaptive; // Состояние опции --adaptive
+    Compressor compressor; // Состояние опции --compress
+
+    // Обработка флага --compress
+    if (flags.compress) {
+        compressorStart(&compressor, &out, flags.compress);
+    }
+
+    // Обработка флагов --strip и --normalize: вход не раскрашивается, а очищается
+    if (flags.strip) {
+        for (char **fileName = inputsBegin; fileName < inputsEnd; fileName++) {
+            int fd = strcmp(*fileName, "-") ? open(*fileName, O_RDONLY) : STDIN_FILENO;
+
+            if (fd < 0) {
+                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *fileName, strerror(errno));
+                outClose(&out);
+                return ERROR;
+            }
+
+            if (stripFile(fd, &out, flags.strip) != OK) {
                 fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *fileName, strerror(errno));
-                fclose(filePtr);
+                outClose(&out);
                 return ERROR;
             }
 
-            // Если возникла ошибка при закрытии файла
-            if (fclose(filePtr)) {
-                fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *fileName, strerror(errno));
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+        }
+
+        return outClose(&out);
+    }
+
+    // Обработка флага --adaptive
+    if (flags.adaptive && hasColor) {
+        adaptiveInit(&adaptive, &flags, STDOUT_FILENO, &gradient);
+        out.adaptive = &adaptive;
+    }
+
+    // Обработка флага --invert
+    if (flags.i) {
+        if (flags.x) {
+            outPrintf(&out, "\033[30m\n"); // Установка цвета фона
+        } else {
+            outPrintf(&out, "\033[38;5;16m\n"); // Установка цвета текста
+        }
+    }
+
+    // Обработка флага --cache (вывод зависит только от входа и опций, поэтому его можно переиспользовать)
+    if (flags.cache && hasColor) {
+        cacheInputs = calloc(inputCount, sizeof(*cacheInputs));
+
+        if (!cacheInputs) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(ERROR);
+        }
+
+        cachedCount = cachePreload(inputsBegin, inputCount, cacheInputs);
+
+        // Если какой-то файл не прочитался, о нем как обычно сообщит основной цикл, а кеш не используется
+        if (cachedCount == inputCount && cacheDirectory(flags.cacheDir, cacheDir, sizeof(cacheDir)) == OK) {
+            char name[CACHE_NAME_LENGTH + 1];
+
+            cacheName(cacheInputs, inputCount, &options, &gradient, name);
+            snprintf(cachePath, sizeof(cachePath), "%s/%s", cacheDir, name);
+
+            if (cacheServe(cachePath, STDOUT_FILENO) == OK) {
+                return OK;
+            }
+
+            // Промах: вывод пишется во временный файл, который затем становится файлом кеша
+            snprintf(cacheTmpPath, sizeof(cacheTmpPath), "%s/" CACHE_TMP_PREFIX "XXXXXX", cacheDir);
+            out.fd = mkstemp(cacheTmpPath);
+            out.lineBuffered = false;
+
+            if (out.fd < 0) {
+                fwprintf(stderr, L"Cannot write cache in \"%s\": %s\n", cacheDir, strerror(errno));
+                out.fd = STDOUT_FILENO;
+                cachePath[0] = '\0';
+            }
+        } else if (cachedCount == inputCount) {
+            fwprintf(stderr, L"Cannot create cache directory: %s\n", strerror(errno));
+        }
+    }
+
+
+    // Обработка флага --jobs
+    if (flags.jobs) {
+        for (char **fileName = inputsBegin; fileName < inputsEnd; fileName++) {
+            if (!strcmp(*fileName, "-")) {
+                wprintf(L"--jobs can't read standard input\n");
+                exit(ERROR);
+            }
+        }
+
+        errCode = colorizeParallel(inputsBegin, inputsEnd - inputsBegin, &out, &options, flags.jobs);
+
+        if (outClose(&out) != OK) {
+            errCode = ERROR;
+        }
+
+        return errCode;
+    }
+
+    // Чтение и обработка файлов
+    for (char **fileName = inputsBegin; fileName < inputsEnd && !state.rangeDone; fileName++) {
+        FILE *filePtr;
+        size_t inputIndex = fileName - inputsBegin;
+
+        if (inputIndex < cachedCount) {
+            // Файл уже прочитан в память для --cache
+            CacheInput *input = &cacheInputs[inputIndex];
+            static char empty[1];
+
+            filePtr = fmemopen(input->data ? input->data : empty, input->size, "r");
+
+            if (!filePtr) {
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *fileName, strerror(errno));
+                outClose(&out);
+                return ERROR;
+            }
+        } else if (!strcmp(*fileName, "-")) {
+            filePtr = stdin; // Использование стандартного ввода
+        } else {
+            // Открытие файла для чтения
+            if ((filePtr = fopen(*fileName, "r")) == NULL) {
+                // Вывод сообщения об ошибке, если файл не удалось открыть
+                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *fileName, strerror(errno));
+                outClose(&out);
                 return ERROR;
             }
         }
+
+        if (colorizeFile(filePtr, *fileName, &out, &options, &state) != OK) {
+            fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *fileName, strerror(errno));
+            fclose(filePtr);
+            outClose(&out);
+            return ERROR;
+        }
+
+        // Если возникла ошибка при закрытии файла
+        if (fclose(filePtr)) {
+            fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *fileName, strerror(errno));
+            outClose(&out);
+            return ERROR;
+        }
+    }
+
+    if (outClose(&out) != OK) {
+        errCode = ERROR;
+    }
+
+    // Завершение промаха --cache: временный файл становится файлом кеша и выводится
+    if (cachePath[0]) {
+        int renamed = !close(out.fd) && !rename(cacheTmpPath, cachePath);
+
+        if (cacheServe(renamed ? cachePath : cacheTmpPath, STDOUT_FILENO) != OK) {
+            fwprintf(stderr, L"Cannot write cached output: %s\n", strerror(errno));
+            errCode = ERROR;
+        }
+
+        // Вывод не должен теряться из-за кеша: не ставший файлом кеша временный файл удаляется после вывода
+        if (!renamed) {
+            unlink(cacheTmpPath);
+        }
+
+        cacheEvict(cacheDir, (long long)flags.cacheSize * 1024 * 1024);
+    }
+
+    for (size_t i = 0; i < cachedCount; ++i) {
+        free(cacheInputs[i].data);
     }
 
+    free(cacheInputs);
+
     return errCode;
 }